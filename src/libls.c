@@ -0,0 +1,2613 @@
+/*
+ * libls: embeddable directory listing library (Version 1.7.0)
+ * Author: BSDSF23M002
+ * Description: Directory scanning with an opt-in on-disk listing cache
+ *              revalidated against the directory's inode and timestamps,
+ *              an inotify-driven watch mode, -s with per-directory
+ *              totals, a parallel du summary, and -a/-A with
+ *              include/exclude name filters applied before stat.
+ *              Multiple path operands are listed GNU-style, with the
+ *              operand directories scanned concurrently. Under a memory
+ *              limit, sorting spills runs to disk and merges them.
+ *              Trees can be saved as binary snapshots and diffed later.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/inotify.h>
+#include <pwd.h>
+#include <grp.h>
+#include <time.h>
+#include <pthread.h>
+#include <fnmatch.h>
+#include <regex.h>
+
+#include "libls.h"
+
+#define COLOR_RESET "\033[0m"
+#define COLOR_BLUE "\033[0;34m"
+#define COLOR_GREEN "\033[0;32m"
+#define COLOR_RED "\033[0;31m"
+#define COLOR_MAGENTA "\033[0;35m"
+#define COLOR_REVERSE "\033[7m"
+#define COLOR_BROKEN "\033[1;31m"
+
+// Sorted entries of one directory, stored as a structure of arrays:
+// names are packed into one blob addressed by 32-bit offsets, metadata
+// lives in narrowed parallel arrays indexed by record, and display
+// order is a permutation of record indices so sorting never moves the
+// records. About 54 bytes per entry plus the name, against ~180 for a
+// pointer, a separate name allocation and a full struct stat.
+//
+// On a cache hit every array points straight into cache_map.
+struct listing {
+    int count;              // rows in display order
+    int nrec;               // records stored (more than count after watch removals)
+    int capacity;
+    int max_len;
+    dev_t dev;              // device of the directory the entries live in
+    const char *dir;        // directory names are relative to, NULL for the cwd (not owned)
+    char *names;
+    size_t names_len;
+    size_t names_cap;
+    uint32_t *name_off;
+    uint16_t *mode;
+    uint32_t *nlink;
+    uint32_t *uid;
+    uint32_t *gid;
+    uint64_t *ino;
+    uint64_t *size;
+    uint64_t *blocks;
+    int64_t *mtime;
+    uint32_t *order;        // display position -> record index
+    void *cache_map;
+    size_t cache_len;
+};
+
+static void free_listing(struct listing *l);
+
+// Bytes a listing spends per record outside the names blob
+#define RECORD_BYTES (5 * sizeof(uint32_t) + sizeof(uint16_t) + 4 * sizeof(uint64_t))
+
+static const char *entry_name(const struct listing *l, uint32_t i) {
+    return l->names + l->name_off[i];
+}
+
+// The metadata of one entry as the public API reports it
+static void entry_stat(const struct listing *l, uint32_t i, struct ls_stat *st) {
+    st->dev = l->dev;
+    st->ino = l->ino[i];
+    st->mode = l->mode[i];
+    st->nlink = l->nlink[i];
+    st->uid = l->uid[i];
+    st->gid = l->gid[i];
+    st->size = l->size[i];
+    st->blocks = l->blocks[i];
+    st->mtime = l->mtime[i];
+}
+
+static void set_entry_stat(struct listing *l, uint32_t i, const struct stat *st) {
+    l->mode[i] = st->st_mode;
+    l->nlink[i] = st->st_nlink > UINT32_MAX ? UINT32_MAX : st->st_nlink;
+    l->uid[i] = st->st_uid;
+    l->gid[i] = st->st_gid;
+    l->ino[i] = st->st_ino;
+    l->size[i] = st->st_size;
+    l->blocks[i] = st->st_blocks;
+    l->mtime[i] = st->st_mtime;
+}
+
+static int grow_arrays(struct listing *l, int capacity) {
+#define GROW(field) do { \
+        void *tmp = realloc(l->field, capacity * sizeof(*l->field)); \
+        if (!tmp) return -1; \
+        l->field = tmp; \
+    } while (0)
+    GROW(name_off); GROW(mode); GROW(nlink); GROW(uid); GROW(gid);
+    GROW(ino); GROW(size); GROW(blocks); GROW(mtime); GROW(order);
+#undef GROW
+    l->capacity = capacity;
+    return 0;
+}
+
+// Store a name and append a record for it at the end of the display
+// order. The caller fills in the metadata. Returns the record index,
+// or -1 when out of memory or past the 32-bit name offset limit.
+static int listing_add(struct listing *l, const char *name) {
+    size_t len = strlen(name);
+    if (l->nrec >= l->capacity && grow_arrays(l, l->capacity ? l->capacity * 2 : 16) == -1)
+        return -1;
+    if (l->names_len + len + 1 > l->names_cap) {
+        size_t cap = l->names_cap ? l->names_cap * 2 : 256;
+        while (cap < l->names_len + len + 1) cap *= 2;
+        if (cap > (size_t)UINT32_MAX + 1) cap = (size_t)UINT32_MAX + 1;
+        if (l->names_len + len + 1 > cap) return -1;
+        char *tmp = realloc(l->names, cap);
+        if (!tmp) return -1;
+        l->names = tmp;
+        l->names_cap = cap;
+    }
+
+    int i = l->nrec++;
+    memcpy(l->names + l->names_len, name, len + 1);
+    l->name_off[i] = l->names_len;
+    l->names_len += len + 1;
+    l->order[l->count++] = i;
+    if ((int)len > l->max_len) l->max_len = len;
+    return i;
+}
+
+// Copy the rows of a listing, in display order, into fresh owned storage
+static int listing_copy(struct listing *dst, const struct listing *l) {
+    struct listing n = {0};
+    n.dev = l->dev;
+    if (l->count > 0 && grow_arrays(&n, l->count) == -1) goto fail;
+    if (l->names_len > 0) {
+        n.names = malloc(l->names_len);
+        if (!n.names) goto fail;
+        n.names_cap = l->names_len;
+    }
+    for (int p = 0; p < l->count; p++) {
+        uint32_t i = l->order[p];
+        int j = listing_add(&n, entry_name(l, i));
+        if (j == -1) goto fail;
+        n.mode[j] = l->mode[i];
+        n.nlink[j] = l->nlink[i];
+        n.uid[j] = l->uid[i];
+        n.gid[j] = l->gid[i];
+        n.ino[j] = l->ino[i];
+        n.size[j] = l->size[i];
+        n.blocks[j] = l->blocks[i];
+        n.mtime[j] = l->mtime[i];
+    }
+    n.max_len = l->max_len;
+    *dst = n;
+    return 0;
+
+fail:
+    free_listing(&n);
+    return -1;
+}
+
+// Detach a listing from a cache mapping, or drop records that watch
+// mode has removed from the order.
+static int listing_compact(struct listing *l) {
+    struct listing n;
+    if (listing_copy(&n, l) == -1) return -1;
+    n.dir = l->dir;
+    free_listing(l);
+    *l = n;
+    return 0;
+}
+
+// Directory fd to read a listing's links relative to
+static int open_link_dir(const struct listing *l) {
+    return l->dir ? open(l->dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC) : AT_FDCWD;
+}
+
+// ----- On-disk cache format -----
+// The cache holds the same arrays as struct listing, already in sorted
+// order, so a hit maps them in place without copying:
+// header | ino | size | blocks | mtime | order | name_off | nlink | uid | gid | mode | names
+#define CACHE_MAGIC   0x534c594du  /* "MYLS" */
+#define CACHE_VERSION 3
+
+struct cache_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t dev;
+    uint64_t ino;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    int64_t ctime_sec;
+    int64_t ctime_nsec;
+    uint64_t filter_sig;     // listings depend on -a/-A and the name filters
+    uint32_t count;
+    uint32_t max_len;
+    uint64_t names_len;
+};
+
+_Static_assert(sizeof(struct cache_header) % 8 == 0, "cache arrays must stay 8-byte aligned");
+
+// Byte offset of each array in a cache file holding count records
+struct cache_layout {
+    size_t ino, size, blocks, mtime, order, name_off, nlink, uid, gid, mode, names, end;
+};
+
+static void cache_layout(struct cache_layout *lay, size_t count, size_t names_len) {
+    size_t off = sizeof(struct cache_header);
+    lay->ino = off;      off += count * sizeof(uint64_t);
+    lay->size = off;     off += count * sizeof(uint64_t);
+    lay->blocks = off;   off += count * sizeof(uint64_t);
+    lay->mtime = off;    off += count * sizeof(int64_t);
+    lay->order = off;    off += count * sizeof(uint32_t);
+    lay->name_off = off; off += count * sizeof(uint32_t);
+    lay->nlink = off;    off += count * sizeof(uint32_t);
+    lay->uid = off;      off += count * sizeof(uint32_t);
+    lay->gid = off;      off += count * sizeof(uint32_t);
+    lay->mode = off;     off += count * sizeof(uint16_t);
+    lay->names = off;    off += names_len;
+    lay->end = off;
+}
+
+// ----- Name filters -----
+// Patterns are compiled once and checked against the raw dirent name,
+// before any allocation or stat. Plain "*.log" / "core*" / "name"
+// globs are reduced to literal suffix, prefix and exact compares.
+enum pattern_kind { PAT_LITERAL, PAT_SUFFIX, PAT_PREFIX, PAT_GLOB, PAT_REGEX };
+
+struct pattern {
+    enum pattern_kind kind;
+    char *source;       // the pattern as given
+    const char *text;   // literal part, or the whole glob
+    size_t len;
+    regex_t re;
+};
+
+struct name_filter {
+    struct pattern **include;
+    int ninclude;
+    struct pattern **exclude;
+    int nexclude;
+    struct pattern **prune;     // directories walks do not enter
+    int nprune;
+    uint64_t sig;       // identifies the filter set in cache headers
+};
+
+// ----- uid/gid name cache -----
+struct id_name {
+    unsigned id;
+    char name[64];
+};
+
+struct id_cache {
+    struct id_name *items;
+    int count;
+    int capacity;
+};
+
+// ----- In-memory snapshots -----
+// With opts.keep_listings, sorted listings stay in memory between calls
+// in a direct-mapped table keyed by the directory's (dev, ino), and are
+// revalidated against its timestamps just like the on-disk cache.
+struct snapshot {
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    struct timespec ctime;
+    int used;
+    struct listing l;
+};
+
+struct snapshot_table {
+    pthread_mutex_t lock;
+    struct snapshot *slots;
+    int nslots;
+};
+
+// ----- Symlink target cache -----
+// How the link targets of one listing resolved, keyed by the target
+// text. Link farms point thousands of links at the same few targets, so
+// this saves a path walk per link. It lives only as long as the listing
+// being rendered, so nothing stale is served to a later request.
+struct link_target {
+    char *text;
+    mode_t mode;            // type of what the link resolves to
+    int dangling;
+};
+
+struct link_targets {
+    int dfd;                // directory the link names are relative to (not owned)
+    struct link_target *slots;
+    size_t cap;             // power of two; 0 until first use
+    size_t used;
+};
+
+static void link_targets_init(struct link_targets *lt, int dfd) {
+    *lt = (struct link_targets){ dfd, NULL, 0, 0 };
+}
+
+static void link_targets_free(struct link_targets *lt) {
+    for (size_t i = 0; i < lt->cap; i++) free(lt->slots[i].text);
+    free(lt->slots);
+}
+
+struct ls_context {
+    struct ls_options opts;
+    char *cache_dir;              // owned copy of opts.cache_dir
+    struct name_filter filter;
+    pthread_mutex_t id_lock;
+    struct id_cache users;
+    struct id_cache groups;
+    struct snapshot_table *snaps; // NULL unless opts.keep_listings
+};
+
+struct ls_scan {
+    struct listing l;
+    char *path;             // l.dir
+    int pos;
+    struct ls_entry cur;    // the record last returned by ls_scan_next()
+};
+
+// Output sink: a stream, or a caller buffer filled snprintf-style
+struct ls_out {
+    FILE *fp;
+    char *buf;
+    size_t cap;
+    size_t len;   // bytes produced so far, may exceed cap
+};
+
+static void out_printf(struct ls_out *o, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    if (o->fp) {
+        vfprintf(o->fp, fmt, ap);
+    } else {
+        size_t room = o->len < o->cap ? o->cap - o->len : 0;
+        int n = vsnprintf(room ? o->buf + o->len : NULL, room, fmt, ap);
+        if (n > 0) o->len += n;
+    }
+    va_end(ap);
+}
+
+// Forward declarations
+struct walk;
+static int list_budgeted(struct ls_context *ctx, struct ls_out *out, const char *dirname, int header,
+                         const struct walk *w);
+static int list_streamed(struct ls_context *ctx, struct ls_out *out, const char *dirname, int header,
+                         const struct walk *w);
+static void print_long_format(struct ls_context *ctx, struct ls_out *out, const struct listing *l);
+static void print_long_row(struct ls_context *ctx, struct ls_out *out, const struct listing *l,
+                           uint32_t i, int bw, struct link_targets *links);
+static void print_down_then_across(struct ls_context *ctx, struct ls_out *out, const struct listing *l);
+static void print_horizontal(struct ls_context *ctx, struct ls_out *out, const struct listing *l);
+static void print_horizontal_item(struct ls_context *ctx, struct ls_out *out, const struct listing *l,
+                                  uint32_t i, int bw, int width, int col_width, int *cur_width);
+static int term_width(const struct ls_context *ctx);
+static void print_colored(struct ls_out *out, const char *filename, mode_t mode);
+
+static int is_dot_or_dotdot(const char *name) {
+    return name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'));
+}
+
+// Compile one include/exclude pattern
+static struct pattern *compile_pattern(const char *text, int is_regex) {
+    struct pattern *p = calloc(1, sizeof(*p));
+    if (!p) { perror("calloc"); return NULL; }
+    p->source = strdup(text);
+    if (!p->source) { perror("strdup"); free(p); return NULL; }
+    p->text = p->source;
+    p->len = strlen(text);
+
+    if (is_regex) {
+        int err = regcomp(&p->re, text, REG_EXTENDED | REG_NOSUB);
+        if (err != 0) {
+            char msg[256];
+            regerror(err, &p->re, msg, sizeof(msg));
+            fprintf(stderr, "invalid regex '%s': %s\n", text, msg);
+            free(p->source);
+            free(p);
+            return NULL;
+        }
+        p->kind = PAT_REGEX;
+    } else if (strpbrk(text, "*?[\\") == NULL) {
+        p->kind = PAT_LITERAL;
+    } else if (text[0] == '*' && strpbrk(text + 1, "*?[\\") == NULL) {
+        p->kind = PAT_SUFFIX;
+        p->text++;
+        p->len--;
+    } else if (p->len > 0 && text[p->len - 1] == '*' &&
+               strcspn(text, "*?[\\") == p->len - 1) {
+        p->kind = PAT_PREFIX;
+        p->len--;
+    } else {
+        p->kind = PAT_GLOB;
+    }
+    return p;
+}
+
+static void free_pattern(struct pattern *p) {
+    if (p->kind == PAT_REGEX) regfree(&p->re);
+    free(p->source);
+    free(p);
+}
+
+static int pattern_match(const struct pattern *p, const char *name, size_t len) {
+    switch (p->kind) {
+        case PAT_LITERAL: return len == p->len && memcmp(name, p->text, len) == 0;
+        case PAT_SUFFIX:  return len >= p->len && memcmp(name + len - p->len, p->text, p->len) == 0;
+        case PAT_PREFIX:  return len >= p->len && memcmp(name, p->text, p->len) == 0;
+        case PAT_GLOB:    return fnmatch(p->text, name, 0) == 0;
+        case PAT_REGEX:   return regexec(&p->re, name, 0, NULL, 0) == 0;
+    }
+    return 0;
+}
+
+// Decide from the name alone whether an entry is listed
+static int name_wanted(const struct ls_context *ctx, const char *name) {
+    const struct name_filter *filter = &ctx->filter;
+    if (name[0] == '.') {
+        if (ctx->opts.show == LS_SHOW_DEFAULT) return 0;
+        if (ctx->opts.show == LS_SHOW_ALMOST_ALL && is_dot_or_dotdot(name)) return 0;
+    }
+    if (filter->ninclude == 0 && filter->nexclude == 0) return 1;
+
+    size_t len = strlen(name);
+    if (filter->ninclude > 0) {
+        int hit = 0;
+        for (int i = 0; i < filter->ninclude && !hit; i++)
+            hit = pattern_match(filter->include[i], name, len);
+        if (!hit) return 0;
+    }
+    for (int i = 0; i < filter->nexclude; i++)
+        if (pattern_match(filter->exclude[i], name, len)) return 0;
+    return 1;
+}
+
+// ----- Traversal pruning -----
+// A walk below one operand. Whether it enters a subdirectory is decided
+// before the subdirectory is opened: --max-depth and --prune from what
+// is already known, --one-file-system at the cost of one lstat.
+struct walk {
+    dev_t root_dev;         // device of the operand
+    int depth;              // levels below the operand; the operand is 0
+};
+
+static int walk_enters(const struct ls_context *ctx, const struct walk *w,
+                       const char *fullpath, const char *name) {
+    if (ctx->opts.max_depth > 0 && w->depth >= ctx->opts.max_depth) return 0;
+    size_t len = strlen(name);
+    for (int i = 0; i < ctx->filter.nprune; i++)
+        if (pattern_match(ctx->filter.prune[i], name, len)) return 0;
+    struct stat st;
+    if (ctx->opts.one_file_system && lstat(fullpath, &st) == 0 && st.st_dev != w->root_dev) return 0;
+    return 1;
+}
+
+static struct walk walk_child(const struct walk *w) {
+    return (struct walk){ w->root_dev, w->depth + 1 };
+}
+
+// FNV-1a over the filter settings, so a cache written with one set of
+// filters is never served for another.
+static void compute_filter_sig(struct ls_context *ctx) {
+    struct name_filter *filter = &ctx->filter;
+    uint64_t h = 0xcbf29ce484222325ull;
+    char show = '0' + ctx->opts.show;
+    const char *parts[2] = { "+", "-" };
+    struct pattern **lists[2] = { filter->include, filter->exclude };
+    int counts[2] = { filter->ninclude, filter->nexclude };
+
+    h = (h ^ (unsigned char)show) * 0x100000001b3ull;
+    for (int k = 0; k < 2; k++) {
+        for (int i = 0; i < counts[k]; i++) {
+            const struct pattern *p = lists[k][i];
+            h = (h ^ (unsigned char)parts[k][0]) * 0x100000001b3ull;
+            h = (h ^ (p->kind == PAT_REGEX ? 'r' : 'g')) * 0x100000001b3ull;
+            for (const char *c = p->source; *c; c++)
+                h = (h ^ (unsigned char)*c) * 0x100000001b3ull;
+            h = (h ^ 0) * 0x100000001b3ull;
+        }
+    }
+    filter->sig = h;
+}
+
+// ----- Context -----
+
+struct ls_context *ls_context_new(const struct ls_options *opts) {
+    struct ls_context *ctx = calloc(1, sizeof(*ctx));
+    if (!ctx) return NULL;
+    ctx->opts = *opts;
+    if (opts->cache_dir) {
+        ctx->cache_dir = strdup(opts->cache_dir);
+        if (!ctx->cache_dir) { free(ctx); return NULL; }
+    }
+    ctx->opts.cache_dir = ctx->cache_dir;
+    if (opts->keep_listings > 0) {
+        ctx->snaps = calloc(1, sizeof(*ctx->snaps));
+        if (ctx->snaps) ctx->snaps->slots = calloc(opts->keep_listings, sizeof(struct snapshot));
+        if (!ctx->snaps || !ctx->snaps->slots) {
+            free(ctx->snaps);
+            free(ctx->cache_dir);
+            free(ctx);
+            return NULL;
+        }
+        ctx->snaps->nslots = opts->keep_listings;
+        pthread_mutex_init(&ctx->snaps->lock, NULL);
+    }
+    pthread_mutex_init(&ctx->id_lock, NULL);
+    compute_filter_sig(ctx);
+    return ctx;
+}
+
+// Add an include or exclude glob (or regex with LS_FILTER_REGEX).
+// Filters must be added before the context is used for scanning.
+int ls_add_filter(struct ls_context *ctx, int flags, const char *pattern) {
+    struct pattern ***list = (flags & LS_FILTER_EXCLUDE) ? &ctx->filter.exclude : &ctx->filter.include;
+    int *n = (flags & LS_FILTER_EXCLUDE) ? &ctx->filter.nexclude : &ctx->filter.ninclude;
+    if (flags & LS_FILTER_PRUNE) {
+        list = &ctx->filter.prune;
+        n = &ctx->filter.nprune;
+    }
+
+    struct pattern *p = compile_pattern(pattern, flags & LS_FILTER_REGEX);
+    if (!p) return -1;
+    struct pattern **tmp = realloc(*list, (*n + 1) * sizeof(*tmp));
+    if (!tmp) { perror("realloc"); free_pattern(p); return -1; }
+    tmp[(*n)++] = p;
+    *list = tmp;
+    compute_filter_sig(ctx);
+    return 0;
+}
+
+void ls_context_free(struct ls_context *ctx) {
+    if (!ctx) return;
+    for (int i = 0; i < ctx->filter.ninclude; i++) free_pattern(ctx->filter.include[i]);
+    for (int i = 0; i < ctx->filter.nexclude; i++) free_pattern(ctx->filter.exclude[i]);
+    for (int i = 0; i < ctx->filter.nprune; i++) free_pattern(ctx->filter.prune[i]);
+    free(ctx->filter.include);
+    free(ctx->filter.exclude);
+    free(ctx->filter.prune);
+    free(ctx->users.items);
+    free(ctx->groups.items);
+    if (ctx->snaps) {
+        for (int i = 0; i < ctx->snaps->nslots; i++)
+            if (ctx->snaps->slots[i].used) free_listing(&ctx->snaps->slots[i].l);
+        free(ctx->snaps->slots);
+        pthread_mutex_destroy(&ctx->snaps->lock);
+        free(ctx->snaps);
+    }
+    pthread_mutex_destroy(&ctx->id_lock);
+    free(ctx->cache_dir);
+    free(ctx);
+}
+
+// Resolve a uid or gid to a name through the context's cache, using the
+// reentrant NSS calls. Unknown ids come back as "?".
+static void lookup_id(struct ls_context *ctx, int is_group, unsigned id, char *buf, size_t len) {
+    struct id_cache *cache = is_group ? &ctx->groups : &ctx->users;
+
+    pthread_mutex_lock(&ctx->id_lock);
+    for (int i = 0; i < cache->count; i++) {
+        if (cache->items[i].id == id) {
+            snprintf(buf, len, "%s", cache->items[i].name);
+            pthread_mutex_unlock(&ctx->id_lock);
+            return;
+        }
+    }
+    pthread_mutex_unlock(&ctx->id_lock);
+
+    char nss_buf[16384];
+    const char *name = NULL;
+    if (is_group) {
+        struct group gr, *res = NULL;
+        if (getgrgid_r(id, &gr, nss_buf, sizeof(nss_buf), &res) == 0 && res) name = res->gr_name;
+    } else {
+        struct passwd pw, *res = NULL;
+        if (getpwuid_r(id, &pw, nss_buf, sizeof(nss_buf), &res) == 0 && res) name = res->pw_name;
+    }
+    snprintf(buf, len, "%s", name ? name : "?");
+
+    pthread_mutex_lock(&ctx->id_lock);
+    if (cache->count >= cache->capacity) {
+        int capacity = cache->capacity ? cache->capacity * 2 : 8;
+        struct id_name *tmp = realloc(cache->items, capacity * sizeof(*tmp));
+        if (tmp) { cache->items = tmp; cache->capacity = capacity; }
+    }
+    if (cache->count < cache->capacity) {
+        cache->items[cache->count].id = id;
+        snprintf(cache->items[cache->count].name, sizeof(cache->items[0].name), "%s", buf);
+        cache->count++;
+    }
+    pthread_mutex_unlock(&ctx->id_lock);
+}
+
+// Comparison function for qsort_r over the display order
+static int cmpfunc(const void *a, const void *b, void *arg) {
+    const struct listing *l = arg;
+    return strcmp(entry_name(l, *(const uint32_t *)a), entry_name(l, *(const uint32_t *)b));
+}
+
+// Sort the display order. An empty listing has no order array, which
+// qsort_r must not be handed even with a zero count.
+static void sort_order(struct listing *l, int (*cmp)(const void *, const void *, void *)) {
+    if (l->count > 1) qsort_r(l->order, l->count, sizeof(uint32_t), cmp, l);
+}
+
+struct spill;
+static int spill_full(const struct listing *l, const struct spill *sp);
+static int spill_batch(struct listing *l, struct spill *sp, int last);
+
+static int cmp_ino(const void *a, const void *b, void *arg) {
+    const struct listing *l = arg;
+    uint64_t x = l->ino[*(const uint32_t *)a], y = l->ino[*(const uint32_t *)b];
+    return (x > y) - (x < y);
+}
+
+// Stat the gathered entries, whose ino holds the dirent's d_ino, in
+// inode number order. On ext4 and similar filesystems that walks the
+// inode table forwards instead of seeking around it in name order,
+// which is what a cold cache pays for. Entries that cannot be stat'ed
+// are dropped from the order; callers sort it by name afterwards.
+static void stat_in_inode_order(int dfd, struct listing *l) {
+    sort_order(l, cmp_ino);
+    int kept = 0;
+    for (int p = 0; p < l->count; p++) {
+        uint32_t i = l->order[p];
+        struct stat st;
+        if (fstatat(dfd, entry_name(l, i), &st, AT_SYMLINK_NOFOLLOW) == -1) {
+            perror(entry_name(l, i));
+            continue;
+        }
+        set_entry_stat(l, i, &st);
+        l->order[kept++] = i;
+    }
+    l->count = kept;
+}
+
+// Gather filenames dynamically, then stat them relative to the directory fd.
+// With a spill state, full runs are sorted out to disk as they fill up.
+static int gather_filenames(const struct ls_context *ctx, const char *path, struct listing *l,
+                            struct spill *sp) {
+    DIR *dir = opendir(path);
+    if (!dir) {
+        perror("opendir");
+        return -1;
+    }
+
+    struct stat dst;
+    if (fstat(dirfd(dir), &dst) == 0) l->dev = dst.st_dev;
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (!name_wanted(ctx, entry->d_name)) continue; // filtered before any stat
+        int i = listing_add(l, entry->d_name);
+        if (i == -1) { perror("listing_add"); break; }
+        l->ino[i] = entry->d_ino;
+        if (sp && spill_full(l, sp)) {
+            stat_in_inode_order(dirfd(dir), l);
+            if (spill_batch(l, sp, 0) == -1) { closedir(dir); return -1; }
+        }
+    }
+    stat_in_inode_order(dirfd(dir), l);
+    if (sp) spill_batch(l, sp, 1);
+    closedir(dir);
+    return 0;
+}
+
+// ----- Listing cache -----
+
+// Create the cache directory (and its parent) if needed
+static int ensure_cache_dir(const char *cache_dir) {
+    char tmp[1024];
+    snprintf(tmp, sizeof(tmp), "%s", cache_dir);
+    for (char *p = tmp + 1; *p; p++) {
+        if (*p != '/') continue;
+        *p = '\0';
+        if (mkdir(tmp, 0700) == -1 && errno != EEXIST) return -1;
+        *p = '/';
+    }
+    if (mkdir(tmp, 0700) == -1 && errno != EEXIST) return -1;
+    return 0;
+}
+
+// Cache files are keyed by the directory's (dev, ino), not its path
+static void cache_path(const char *cache_dir, const struct stat *dst, char *buf, size_t len) {
+    snprintf(buf, len, "%s/%lx-%lx.cache", cache_dir,
+             (unsigned long)dst->st_dev, (unsigned long)dst->st_ino);
+}
+
+// Map a cache file and use it if it still describes the directory.
+// Returns 0 on a hit, -1 if a full scan is needed.
+static int cache_load(const struct ls_context *ctx, const struct stat *dst, struct listing *out) {
+    char cpath[1024];
+    cache_path(ctx->cache_dir, dst, cpath, sizeof(cpath));
+
+    int fd = open(cpath, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return -1;
+
+    struct stat cst;
+    if (fstat(fd, &cst) == -1 || (size_t)cst.st_size < sizeof(struct cache_header)) {
+        close(fd);
+        return -1;
+    }
+    size_t len = cst.st_size;
+    void *map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return -1;
+
+    const struct cache_header *h = map;
+    struct cache_layout lay;
+    cache_layout(&lay, h->count, h->names_len);
+    if (h->magic != CACHE_MAGIC || h->version != CACHE_VERSION || h->filter_sig != ctx->filter.sig ||
+        h->dev != (uint64_t)dst->st_dev || h->ino != (uint64_t)dst->st_ino ||
+        h->mtime_sec != dst->st_mtim.tv_sec || h->mtime_nsec != dst->st_mtim.tv_nsec ||
+        h->ctime_sec != dst->st_ctim.tv_sec || h->ctime_nsec != dst->st_ctim.tv_nsec ||
+        lay.end != len || (h->names_len > 0 && ((char *)map)[len - 1] != '\0')) {
+        munmap(map, len);
+        return -1;
+    }
+
+    char *base = map;
+    struct listing l = {0};
+    l.count = l.nrec = l.capacity = h->count;
+    l.max_len = h->max_len;
+    l.dev = dst->st_dev;
+    l.names = base + lay.names;
+    l.names_len = h->names_len;
+    l.ino = (uint64_t *)(base + lay.ino);
+    l.size = (uint64_t *)(base + lay.size);
+    l.blocks = (uint64_t *)(base + lay.blocks);
+    l.mtime = (int64_t *)(base + lay.mtime);
+    l.order = (uint32_t *)(base + lay.order);
+    l.name_off = (uint32_t *)(base + lay.name_off);
+    l.nlink = (uint32_t *)(base + lay.nlink);
+    l.uid = (uint32_t *)(base + lay.uid);
+    l.gid = (uint32_t *)(base + lay.gid);
+    l.mode = (uint16_t *)(base + lay.mode);
+    l.cache_map = map;
+    l.cache_len = len;
+
+    // Bounds-check the offsets so a damaged file cannot send reads astray
+    for (uint32_t i = 0; i < h->count; i++) {
+        if (l.name_off[i] >= h->names_len || l.order[i] >= h->count) {
+            munmap(map, len);
+            return -1;
+        }
+    }
+
+    *out = l;
+    return 0;
+}
+
+// Write one array of the listing to the cache, permuted into display order
+static int write_sorted(FILE *fp, const struct listing *l, const void *array, size_t width) {
+    char buf[4096];
+    size_t per = sizeof(buf) / width, n = 0;
+    for (int p = 0; p < l->count; p++) {
+        memcpy(buf + n * width, (const char *)array + (size_t)l->order[p] * width, width);
+        if (++n == per) {
+            if (fwrite(buf, width, n, fp) != n) return 0;
+            n = 0;
+        }
+    }
+    return n == 0 || fwrite(buf, width, n, fp) == n;
+}
+
+// Write a sorted listing to the cache. The file is written under a
+// temporary name and renamed so readers never see a partial cache.
+static void cache_store(const struct ls_context *ctx, const struct stat *dst, const struct listing *l) {
+    // A directory modified within the last second may change again
+    // without its timestamp moving on coarse-grained filesystems.
+    if (time(NULL) - dst->st_mtime < 2) return;
+    if (ensure_cache_dir(ctx->cache_dir) == -1) return;
+
+    struct cache_header h = {0};
+    h.magic = CACHE_MAGIC;
+    h.version = CACHE_VERSION;
+    h.filter_sig = ctx->filter.sig;
+    h.dev = dst->st_dev;
+    h.ino = dst->st_ino;
+    h.mtime_sec = dst->st_mtim.tv_sec;
+    h.mtime_nsec = dst->st_mtim.tv_nsec;
+    h.ctime_sec = dst->st_ctim.tv_sec;
+    h.ctime_nsec = dst->st_ctim.tv_nsec;
+    h.count = l->count;
+    h.max_len = l->max_len;
+    h.names_len = l->names_len;
+
+    // Temporary name is unique per thread, as scans may run concurrently
+    char cpath[1024], tmp[1100];
+    cache_path(ctx->cache_dir, dst, cpath, sizeof(cpath));
+    snprintf(tmp, sizeof(tmp), "%s.%ld.%lx", cpath, (long)getpid(), (unsigned long)pthread_self());
+
+    FILE *fp = fopen(tmp, "wb");
+    if (!fp) return;
+    int ok = fwrite(&h, sizeof(h), 1, fp) == 1 &&
+             write_sorted(fp, l, l->ino, sizeof(*l->ino)) &&
+             write_sorted(fp, l, l->size, sizeof(*l->size)) &&
+             write_sorted(fp, l, l->blocks, sizeof(*l->blocks)) &&
+             write_sorted(fp, l, l->mtime, sizeof(*l->mtime));
+    // Records are written in display order, so the stored order is the identity
+    for (uint32_t p = 0; ok && p < (uint32_t)l->count; p++)
+        ok = fwrite(&p, sizeof(p), 1, fp) == 1;
+    ok = ok && write_sorted(fp, l, l->name_off, sizeof(*l->name_off)) &&
+         write_sorted(fp, l, l->nlink, sizeof(*l->nlink)) &&
+         write_sorted(fp, l, l->uid, sizeof(*l->uid)) &&
+         write_sorted(fp, l, l->gid, sizeof(*l->gid)) &&
+         write_sorted(fp, l, l->mode, sizeof(*l->mode)) &&
+         (l->names_len == 0 || fwrite(l->names, l->names_len, 1, fp) == 1);
+    if (fclose(fp) != 0) ok = 0;
+    if (!ok || rename(tmp, cpath) == -1) unlink(tmp);
+}
+
+static struct snapshot *snapshot_slot(struct snapshot_table *t, const struct stat *dst) {
+    uint64_t h = ((uint64_t)dst->st_dev * 0x9e3779b97f4a7c15ull) ^ (uint64_t)dst->st_ino;
+    return &t->slots[(h ^ (h >> 29)) % t->nslots];
+}
+
+static int same_time(const struct timespec *a, const struct timespec *b) {
+    return a->tv_sec == b->tv_sec && a->tv_nsec == b->tv_nsec;
+}
+
+// Copy a still-valid snapshot of the directory into l. Returns 0 on a hit.
+static int snapshot_load(struct snapshot_table *t, const struct stat *dst, struct listing *l) {
+    int rc = -1;
+    pthread_mutex_lock(&t->lock);
+    struct snapshot *s = snapshot_slot(t, dst);
+    if (s->used && s->dev == dst->st_dev && s->ino == dst->st_ino &&
+        same_time(&s->mtime, &dst->st_mtim) && same_time(&s->ctime, &dst->st_ctim))
+        rc = listing_copy(l, &s->l);
+    pthread_mutex_unlock(&t->lock);
+    return rc;
+}
+
+static void snapshot_store(struct snapshot_table *t, const struct stat *dst, const struct listing *l) {
+    // Same rule as the on-disk cache: a fresh mtime may not move again
+    if (time(NULL) - dst->st_mtime < 2) return;
+    struct listing copy;
+    if (listing_copy(&copy, l) == -1) return;
+
+    pthread_mutex_lock(&t->lock);
+    struct snapshot *s = snapshot_slot(t, dst);
+    if (s->used) free_listing(&s->l);
+    s->dev = dst->st_dev;
+    s->ino = dst->st_ino;
+    s->mtime = dst->st_mtim;
+    s->ctime = dst->st_ctim;
+    s->l = copy;
+    s->used = 1;
+    pthread_mutex_unlock(&t->lock);
+}
+
+// Produce the sorted listing of a directory, from a snapshot or the
+// cache when one is valid
+static int load_listing(const struct ls_context *ctx, const char *dirname, struct listing *l) {
+    memset(l, 0, sizeof(*l));
+
+    struct stat dst;
+    int have_dst = (ctx->snaps || ctx->cache_dir) && stat(dirname, &dst) == 0;
+    if (have_dst && ctx->snaps && snapshot_load(ctx->snaps, &dst, l) == 0) return 0;
+    int use_cache = have_dst && ctx->cache_dir;
+    if (use_cache && cache_load(ctx, &dst, l) == 0) {
+        if (ctx->snaps) snapshot_store(ctx->snaps, &dst, l);
+        return 0;
+    }
+
+    if (gather_filenames(ctx, dirname, l, NULL) == -1) {
+        free_listing(l);
+        return -1;
+    }
+
+    // Sort alphabetically by permuting the order array only
+    sort_order(l, cmpfunc);
+
+    if (use_cache) cache_store(ctx, &dst, l);
+    if (have_dst && ctx->snaps) snapshot_store(ctx->snaps, &dst, l);
+    return 0;
+}
+
+static void free_listing(struct listing *l) {
+    if (l->cache_map) {
+        munmap(l->cache_map, l->cache_len);
+        return;
+    }
+    free(l->names);
+    free(l->name_off);
+    free(l->mode);
+    free(l->nlink);
+    free(l->uid);
+    free(l->gid);
+    free(l->ino);
+    free(l->size);
+    free(l->blocks);
+    free(l->mtime);
+    free(l->order);
+}
+
+// Allocated size in 1K blocks, rounded up as ls and du report it
+static long long kblocks(uint64_t blocks) {
+    return ((long long)blocks + 1) / 2;
+}
+
+// Width of the widest -s block count in a listing
+static int blocks_width(const struct listing *l) {
+    int width = 1;
+    for (int p = 0; p < l->count; p++) {
+        int w = snprintf(NULL, 0, "%lld", kblocks(l->blocks[l->order[p]]));
+        if (w > width) width = w;
+    }
+    return width;
+}
+
+// Choose display mode
+static void print_entries(struct ls_context *ctx, struct ls_out *out, struct listing *l) {
+    if (ctx->opts.long_format) print_long_format(ctx, out, l);
+    else if (ctx->opts.horizontal) print_horizontal(ctx, out, l);
+    else print_down_then_across(ctx, out, l);
+}
+
+// Print a directory's entries, preceded by its total with -l or -s
+static void display_listing(struct ls_context *ctx, struct ls_out *out, struct listing *l) {
+    if (ctx->opts.long_format || ctx->opts.size) {
+        long long total = 0;
+        for (int p = 0; p < l->count; p++) total += kblocks(l->blocks[l->order[p]]);
+        out_printf(out, "total %lld\n", total);
+    }
+    print_entries(ctx, out, l);
+}
+
+static void do_ls(struct ls_context *ctx, struct ls_out *out, const char *dirname,
+                  const struct walk *w);
+
+// Print an already loaded directory and, with -R, descend into it
+static void descend(struct ls_context *ctx, struct ls_out *out, const char *dirname,
+                    const struct listing *l, const struct walk *w);
+
+static void show_listing(struct ls_context *ctx, struct ls_out *out, const char *dirname,
+                         struct listing *l, int header, const struct walk *w) {
+    if (header) out_printf(out, "%s:\n", dirname);
+    l->dir = dirname;
+
+    display_listing(ctx, out, l);
+    descend(ctx, out, dirname, l, w);
+}
+
+// Recursive descent into the subdirectories of a listing shown with -R
+static void descend(struct ls_context *ctx, struct ls_out *out, const char *dirname,
+                    const struct listing *l, const struct walk *w) {
+    if (!ctx->opts.recursive) return;
+    struct walk child = walk_child(w);
+    for (int p = 0; p < l->count; p++) {
+        uint32_t i = l->order[p];
+        if (!S_ISDIR(l->mode[i]) || is_dot_or_dotdot(entry_name(l, i))) continue;
+        char fullpath[1024];
+        snprintf(fullpath, sizeof(fullpath), "%s/%s", dirname, entry_name(l, i));
+        if (!walk_enters(ctx, w, fullpath, entry_name(l, i))) continue;
+        out_printf(out, "\n");
+        do_ls(ctx, out, fullpath, &child);
+    }
+}
+
+// --stream applies to plain long listings; -s needs every entry's
+// blocks before the first row to size its column.
+static int streaming(const struct ls_context *ctx) {
+    return ctx->opts.stream && ctx->opts.long_format && !ctx->opts.size;
+}
+
+// Recursive listing function
+static void do_ls(struct ls_context *ctx, struct ls_out *out, const char *dirname,
+                  const struct walk *w) {
+    if (ctx->opts.memory_limit) {
+        list_budgeted(ctx, out, dirname, ctx->opts.recursive, w);
+        return;
+    }
+    if (streaming(ctx)) {
+        list_streamed(ctx, out, dirname, ctx->opts.recursive, w);
+        return;
+    }
+
+    struct listing l;
+    if (load_listing(ctx, dirname, &l) == -1) return;
+
+    // Print directory header if recursive
+    show_listing(ctx, out, dirname, &l, ctx->opts.recursive, w);
+
+    free_listing(&l);
+}
+
+// Threads used for concurrent scans. Scanning is bound by stat latency
+// more than CPU, so use a few threads even on small machines.
+static int worker_count(void) {
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    return ncpu < 4 ? 4 : (ncpu > 16 ? 16 : (int)ncpu);
+}
+
+// ----- External merge sort (--memory-limit) -----
+// Entries are gathered into a listing until it reaches half the memory
+// budget, then that run is sorted and spilled to an unlinked temporary
+// file as fixed-size records followed by the name bytes. Runs are
+// k-way merged straight into the display stage, in extra passes when
+// there are more runs than MERGE_FAN_IN.
+#define MERGE_FAN_IN 64
+
+struct spill_record {
+    uint64_t ino;
+    uint64_t size;
+    uint64_t blocks;
+    int64_t mtime;
+    uint32_t nlink;
+    uint32_t uid;
+    uint32_t gid;
+    uint16_t mode;
+    uint16_t name_len;
+};
+
+// Everything the display stage needs to know without holding the entries
+struct spill {
+    size_t budget;
+    FILE **runs;
+    int nruns;
+    long long total_kblocks;    // summed per entry, as display_listing does
+    uint64_t max_blocks;
+    int max_len;
+};
+
+// One input of the merge, holding its current record as record 0
+struct run_reader {
+    FILE *fp;
+    struct listing l;
+};
+
+static FILE *spill_file(void) {
+    const char *dir = getenv("TMPDIR");
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/myls-run-XXXXXX", dir && *dir ? dir : "/tmp");
+    int fd = mkstemp(path);
+    if (fd == -1) { perror("mkstemp"); return NULL; }
+    unlink(path);
+    FILE *fp = fdopen(fd, "w+b");
+    if (!fp) { perror("fdopen"); close(fd); }
+    return fp;
+}
+
+// Write record i of a listing under the given name (snapshots store paths)
+static int write_spill_record(FILE *fp, const struct listing *l, uint32_t i, const char *name) {
+    struct spill_record rec = {
+        l->ino[i], l->size[i], l->blocks[i], l->mtime[i],
+        l->nlink[i], l->uid[i], l->gid[i], l->mode[i], (uint16_t)strlen(name)
+    };
+    return fwrite(&rec, sizeof(rec), 1, fp) == 1 &&
+           fwrite(name, rec.name_len, 1, fp) == 1;
+}
+
+// Read the next record of a run into r->l. Returns 1, 0 at the end of
+// the run, or -1 on a read error or truncated record.
+static int read_spill_record(struct run_reader *r) {
+    struct spill_record rec;
+    char name[65536];
+    size_t got = fread(&rec, 1, sizeof(rec), r->fp);
+    if (got == 0 && !ferror(r->fp)) return 0;
+    if (ferror(r->fp)) { perror("spill"); return -1; }
+    if (got != sizeof(rec) || (rec.name_len > 0 && fread(name, rec.name_len, 1, r->fp) != 1)) {
+        fprintf(stderr, "spill: truncated record\n");
+        return -1;
+    }
+    name[rec.name_len] = '\0';
+
+    r->l.count = r->l.nrec = 0;
+    r->l.names_len = 0;
+    if (listing_add(&r->l, name) != 0) { perror("listing_add"); return -1; }
+    r->l.mode[0] = rec.mode;
+    r->l.nlink[0] = rec.nlink;
+    r->l.uid[0] = rec.uid;
+    r->l.gid[0] = rec.gid;
+    r->l.ino[0] = rec.ino;
+    r->l.size[0] = rec.size;
+    r->l.blocks[0] = rec.blocks;
+    r->l.mtime[0] = rec.mtime;
+    return 1;
+}
+
+// Sort the gathered entries and move them to a new run on disk
+static int spill_run(struct listing *l, struct spill *sp) {
+    sort_order(l, cmpfunc);
+
+    FILE *fp = spill_file();
+    if (!fp) return -1;
+    int ok = 1;
+    for (int p = 0; ok && p < l->count; p++) ok = write_spill_record(fp, l, l->order[p], entry_name(l, l->order[p]));
+    if (!ok || fflush(fp) != 0) { perror("spill"); fclose(fp); return -1; }
+    rewind(fp);
+
+    FILE **tmp = realloc(sp->runs, (sp->nruns + 1) * sizeof(*tmp));
+    if (!tmp) { fclose(fp); return -1; }
+    sp->runs = tmp;
+    sp->runs[sp->nruns++] = fp;
+
+    // Keep the allocations; the next run reuses them
+    l->count = l->nrec = 0;
+    l->names_len = 0;
+    return 0;
+}
+
+static int reduce_runs(struct spill *sp);
+
+static int spill_full(const struct listing *l, const struct spill *sp) {
+    return l->names_len + (size_t)l->nrec * RECORD_BYTES >= sp->budget;
+}
+
+// Account for a stat'ed run and, unless it is the last, spill it
+static int spill_batch(struct listing *l, struct spill *sp, int last) {
+    for (int p = 0; p < l->count; p++) {
+        uint32_t i = l->order[p];
+        sp->total_kblocks += kblocks(l->blocks[i]);
+        if (l->blocks[i] > sp->max_blocks) sp->max_blocks = l->blocks[i];
+    }
+    if (l->max_len > sp->max_len) sp->max_len = l->max_len;
+    if (last) return 0;
+    if (spill_run(l, sp) == -1) return -1;
+    return sp->nruns > MERGE_FAN_IN ? reduce_runs(sp) : 0;
+}
+
+// Binary min-heap of run indices ordered by their current name
+static int heap_less(struct run_reader *r, int a, int b) {
+    return strcmp(entry_name(&r[a].l, 0), entry_name(&r[b].l, 0)) < 0;
+}
+
+static void heap_down(struct run_reader *r, int *heap, int n, int k) {
+    for (;;) {
+        int least = k, left = 2 * k + 1, right = left + 1;
+        if (left < n && heap_less(r, heap[left], heap[least])) least = left;
+        if (right < n && heap_less(r, heap[right], heap[least])) least = right;
+        if (least == k) return;
+        int t = heap[k]; heap[k] = heap[least]; heap[least] = t;
+        k = least;
+    }
+}
+
+typedef int (*merge_emit)(struct run_reader *r, void *arg);
+
+// Merge n sorted runs, passing every record to emit in order
+static int merge_runs(FILE **runs, int n, merge_emit emit, void *arg) {
+    struct run_reader *r = calloc(n, sizeof(*r));
+    int *heap = malloc(n * sizeof(int));
+    int rc = -1, len = 0;
+    if (!r || !heap) goto out;
+
+    for (int i = 0; i < n; i++) {
+        r[i].fp = runs[i];
+        int got = read_spill_record(&r[i]);
+        if (got == -1) goto out;
+        if (got) heap[len++] = i;
+    }
+    for (int k = len / 2 - 1; k >= 0; k--) heap_down(r, heap, len, k);
+
+    rc = 0;
+    while (len > 0 && rc == 0) {
+        int top = heap[0];
+        rc = emit(&r[top], arg);
+        int got = rc == 0 ? read_spill_record(&r[top]) : 1;
+        if (got == -1) rc = -1;
+        else if (!got) heap[0] = heap[--len];
+        heap_down(r, heap, len, 0);
+    }
+
+out:
+    for (int i = 0; r && i < n; i++) free_listing(&r[i].l);
+    free(r);
+    free(heap);
+    return rc;
+}
+
+static int emit_to_run(struct run_reader *r, void *arg) {
+    if (write_spill_record(arg, &r->l, 0, entry_name(&r->l, 0))) return 0;
+    perror("spill");
+    return -1;
+}
+
+// Merge groups of runs into longer runs until one final merge can
+// keep every input open at once. On failure every run is closed and
+// sp->nruns is 0.
+static int reduce_runs(struct spill *sp) {
+    while (sp->nruns > MERGE_FAN_IN) {
+        int nout = 0;
+        for (int start = 0; start < sp->nruns; start += MERGE_FAN_IN) {
+            int n = sp->nruns - start < MERGE_FAN_IN ? sp->nruns - start : MERGE_FAN_IN;
+            FILE *fp = spill_file();
+            int rc = fp ? merge_runs(sp->runs + start, n, emit_to_run, fp) : -1;
+            if (rc == 0 && fflush(fp) != 0) { perror("spill"); rc = -1; }
+            // Outputs so far sit in runs[0, nout), inputs not yet
+            // consumed in runs[start, nruns)
+            if (rc != 0) {
+                if (fp) fclose(fp);
+                for (int i = 0; i < nout; i++) fclose(sp->runs[i]);
+                for (int i = start; i < sp->nruns; i++) fclose(sp->runs[i]);
+                sp->nruns = 0;
+                return -1;
+            }
+            for (int i = 0; i < n; i++) fclose(sp->runs[start + i]);
+            rewind(fp);
+            sp->runs[nout++] = fp;
+        }
+        sp->nruns = nout;
+    }
+    return 0;
+}
+
+// State of the display stage while merged records stream through it
+struct merge_display {
+    struct ls_context *ctx;
+    struct ls_out *out;
+    int bw;
+    struct link_targets links;  // for -l symlink targets
+    int width;              // terminal width, read once per listing
+    int col_width;
+    int cur_width;
+    int rows;
+    char **subdirs;         // kept for -R, descended into afterwards
+    int nsubdirs;
+};
+
+static int emit_to_display(struct run_reader *r, void *arg) {
+    struct merge_display *md = arg;
+    struct ls_context *ctx = md->ctx;
+
+    if (ctx->opts.long_format) print_long_row(ctx, md->out, &r->l, 0, md->bw, &md->links);
+    else print_horizontal_item(ctx, md->out, &r->l, 0, md->bw, md->width, md->col_width,
+                               &md->cur_width);
+    md->rows++;
+
+    const char *name = entry_name(&r->l, 0);
+    if (ctx->opts.recursive && S_ISDIR(r->l.mode[0]) && !is_dot_or_dotdot(name)) {
+        char **tmp = realloc(md->subdirs, (md->nsubdirs + 1) * sizeof(*tmp));
+        char *copy = strdup(name);
+        if (!tmp || !copy) { free(copy); if (tmp) md->subdirs = tmp; return -1; }
+        md->subdirs = tmp;
+        md->subdirs[md->nsubdirs++] = copy;
+    }
+    return 0;
+}
+
+// List one directory within ctx->opts.memory_limit. Directories that fit
+// in one run are shown exactly as usual; larger ones are merged from
+// disk and, as they cannot be laid out in columns, shown in -x order.
+static int list_budgeted(struct ls_context *ctx, struct ls_out *out, const char *dirname, int header,
+                         const struct walk *w) {
+    struct spill sp = {0};
+    sp.budget = ctx->opts.memory_limit / 2;
+    if (sp.budget < 64 * 1024) sp.budget = 64 * 1024;
+
+    struct listing l = {0};
+    int rc = -1;
+    if (gather_filenames(ctx, dirname, &l, &sp) == -1) goto out;
+    if (sp.nruns == 0) {
+        sort_order(&l, cmpfunc);
+        show_listing(ctx, out, dirname, &l, header, w);
+        free_listing(&l);
+        return 0;
+    }
+
+    if (l.count > 0 && spill_run(&l, &sp) == -1) goto out;
+    free_listing(&l);
+    memset(&l, 0, sizeof(l));
+    if (reduce_runs(&sp) == -1) goto out;
+
+    if (header) out_printf(out, "%s:\n", dirname);
+    if (ctx->opts.long_format || ctx->opts.size) out_printf(out, "total %lld\n", sp.total_kblocks);
+
+    struct merge_display md = { .ctx = ctx, .out = out };
+    link_targets_init(&md.links, -1);
+    if (ctx->opts.long_format) md.links.dfd = open(dirname, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    md.bw = ctx->opts.size ? snprintf(NULL, 0, "%lld", kblocks(sp.max_blocks)) : 0;
+    md.col_width = sp.max_len + 2 + (ctx->opts.size ? md.bw + 1 : 0);
+    if (!ctx->opts.long_format) md.width = term_width(ctx);
+    rc = merge_runs(sp.runs, sp.nruns, emit_to_display, &md);
+    if (!ctx->opts.long_format && md.rows > 0) out_printf(out, "\n");
+    link_targets_free(&md.links);
+    if (md.links.dfd != -1) close(md.links.dfd);
+
+    struct walk child = walk_child(w);
+    for (int i = 0; i < md.nsubdirs; i++) {
+        char fullpath[1024];
+        snprintf(fullpath, sizeof(fullpath), "%s/%s", dirname, md.subdirs[i]);
+        if (walk_enters(ctx, w, fullpath, md.subdirs[i])) {
+            out_printf(out, "\n");
+            do_ls(ctx, out, fullpath, &child);
+        }
+        free(md.subdirs[i]);
+    }
+    free(md.subdirs);
+
+out:
+    free_listing(&l);
+    for (int i = 0; i < sp.nruns; i++) fclose(sp.runs[i]);
+    free(sp.runs);
+    return rc;
+}
+
+// ----- Streamed long listings (--stream) -----
+// The names are read and sorted first. A pool of workers then stats them
+// in display order while the calling thread prints each row as soon as
+// its metadata is in, so the first row does not wait for the last stat.
+// Workers run at most STREAM_WINDOW rows ahead of the printer: enough to
+// keep many stats in flight on a slow mount, without racing through the
+// whole directory while output is blocked. Rows are handed over in
+// chunks to keep locking off the per-row path. The total line needs
+// every entry, so it comes after the rows.
+#define STREAM_WINDOW 256
+#define STREAM_CHUNK 16
+
+enum { ROW_PENDING, ROW_OK, ROW_FAILED };
+
+struct stat_pipe {
+    struct listing *l;
+    int dfd;
+    int next;                   // next display position to stat
+    int limit;                  // workers stop short of this position
+    int idle;                   // workers waiting for room
+    unsigned char *state;       // ROW_* per display position
+    pthread_mutex_t lock;
+    pthread_cond_t ready;       // a row was stat'ed
+    pthread_cond_t room;        // the printer moved on
+};
+
+static void *stat_worker(void *arg) {
+    struct stat_pipe *sp = arg;
+    pthread_mutex_lock(&sp->lock);
+    for (;;) {
+        while (sp->next < sp->l->count && sp->next >= sp->limit) {
+            sp->idle++;
+            pthread_cond_wait(&sp->room, &sp->lock);
+            sp->idle--;
+        }
+        if (sp->next >= sp->l->count) break;
+        int start = sp->next;
+        int end = start + STREAM_CHUNK < sp->limit ? start + STREAM_CHUNK : sp->limit;
+        if (end > sp->l->count) end = sp->l->count;
+        sp->next = end;
+        pthread_mutex_unlock(&sp->lock);
+
+        // Each worker writes only its own records
+        unsigned char done[STREAM_CHUNK];
+        for (int p = start; p < end; p++) {
+            uint32_t i = sp->l->order[p];
+            struct stat st;
+            int ok = fstatat(sp->dfd, entry_name(sp->l, i), &st, AT_SYMLINK_NOFOLLOW) == 0;
+            if (ok) set_entry_stat(sp->l, i, &st);
+            else perror(entry_name(sp->l, i));
+            done[p - start] = ok ? ROW_OK : ROW_FAILED;
+        }
+
+        pthread_mutex_lock(&sp->lock);
+        memcpy(sp->state + start, done, end - start);
+        pthread_cond_signal(&sp->ready);
+    }
+    pthread_mutex_unlock(&sp->lock);
+    return NULL;
+}
+
+static int list_streamed(struct ls_context *ctx, struct ls_out *out, const char *dirname, int header,
+                         const struct walk *w) {
+    DIR *dir = opendir(dirname);
+    if (!dir) {
+        perror("opendir");
+        return -1;
+    }
+
+    // Gather and sort: names only
+    struct listing l = {0};
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (!name_wanted(ctx, entry->d_name)) continue;
+        if (listing_add(&l, entry->d_name) == -1) { perror("listing_add"); break; }
+    }
+    sort_order(&l, cmpfunc);
+    l.dir = dirname;
+
+    struct stat_pipe sp = { .l = &l, .dfd = dirfd(dir), .limit = STREAM_WINDOW,
+                            .state = calloc(l.count + 1, 1) };
+    if (!sp.state) { perror("calloc"); free_listing(&l); closedir(dir); return -1; }
+    pthread_mutex_init(&sp.lock, NULL);
+    pthread_cond_init(&sp.ready, NULL);
+    pthread_cond_init(&sp.room, NULL);
+
+    // Stat
+    int nthreads = worker_count();
+    if (nthreads > l.count) nthreads = l.count;
+    pthread_t *threads = malloc((nthreads ? nthreads : 1) * sizeof(pthread_t));
+    int started = 0;
+    for (int t = 0; threads && t < nthreads; t++) {
+        if (pthread_create(&threads[t], NULL, stat_worker, &sp) != 0) break;
+        started++;
+    }
+    if (started == 0) {
+        sp.limit = l.count;
+        stat_worker(&sp);
+    }
+
+    // Render, in order, each row as it becomes ready
+    if (header) out_printf(out, "%s:\n", dirname);
+    struct link_targets links;
+    link_targets_init(&links, sp.dfd);
+    long long total = 0;
+    int kept = 0;
+    for (int p = 0; p < l.count; ) {
+        pthread_mutex_lock(&sp.lock);
+        if (sp.state[p] == ROW_PENDING) {
+            // Let the rows printed so far out while waiting
+            pthread_mutex_unlock(&sp.lock);
+            if (out->fp) fflush(out->fp);
+            pthread_mutex_lock(&sp.lock);
+            while (sp.state[p] == ROW_PENDING) pthread_cond_wait(&sp.ready, &sp.lock);
+        }
+        // Take every row that is ready, and let the workers move on
+        int end = p + 1;
+        while (end < l.count && sp.state[end] != ROW_PENDING) end++;
+        sp.limit = end + STREAM_WINDOW;
+        if (sp.idle) pthread_cond_broadcast(&sp.room);
+        pthread_mutex_unlock(&sp.lock);
+
+        for (; p < end; p++) {
+            if (sp.state[p] != ROW_OK) continue;
+            uint32_t i = l.order[p];
+            print_long_row(ctx, out, &l, i, 0, &links);
+            total += kblocks(l.blocks[i]);
+            l.order[kept++] = i;
+        }
+    }
+    l.count = kept;
+    out_printf(out, "total %lld\n", total);
+    link_targets_free(&links);
+
+    for (int t = 0; t < started; t++) pthread_join(threads[t], NULL);
+    free(threads);
+    pthread_cond_destroy(&sp.room);
+    pthread_cond_destroy(&sp.ready);
+    pthread_mutex_destroy(&sp.lock);
+    free(sp.state);
+    closedir(dir);
+
+    descend(ctx, out, dirname, &l, w);
+    free_listing(&l);
+    return 0;
+}
+
+// ----- Scan API -----
+
+struct ls_scan *ls_scan_open(struct ls_context *ctx, const char *path) {
+    struct ls_scan *scan = calloc(1, sizeof(*scan));
+    if (!scan) return NULL;
+    scan->path = strdup(path);
+    if (!scan->path || load_listing(ctx, path, &scan->l) == -1) {
+        free(scan->path);
+        free(scan);
+        return NULL;
+    }
+    scan->l.dir = scan->path;
+    return scan;
+}
+
+// The returned record is rebuilt from the compact store and stays
+// valid until the next call on the same scan.
+const struct ls_entry *ls_scan_next(struct ls_scan *scan) {
+    if (scan->pos >= scan->l.count) return NULL;
+    uint32_t i = scan->l.order[scan->pos++];
+    scan->cur.name = (char *)entry_name(&scan->l, i);
+    entry_stat(&scan->l, i, &scan->cur.st);
+    return &scan->cur;
+}
+
+size_t ls_scan_count(const struct ls_scan *scan) {
+    return scan->l.count;
+}
+
+void ls_scan_close(struct ls_scan *scan) {
+    if (!scan) return;
+    free_listing(&scan->l);
+    free(scan->path);
+    free(scan);
+}
+
+int ls_scan_foreach(struct ls_context *ctx, const char *path, ls_entry_cb cb, void *arg) {
+    struct ls_scan *scan = ls_scan_open(ctx, path);
+    if (!scan) return -1;
+    int rc = 0;
+    const struct ls_entry *entry;
+    while (rc == 0 && (entry = ls_scan_next(scan)) != NULL) rc = cb(entry, arg);
+    ls_scan_close(scan);
+    return rc;
+}
+
+size_t ls_render(struct ls_context *ctx, const struct ls_scan *scan, char *buf, size_t len) {
+    struct ls_out out = { NULL, buf, len, 0 };
+    display_listing(ctx, &out, (struct listing *)&scan->l);
+    if (len > 0) buf[out.len < len ? out.len : len - 1] = '\0';
+    return out.len;
+}
+
+// ----- Hard-link dedupe -----
+// Open-addressing set of (dev, ino) pairs. Only multiply-linked inodes
+// are inserted, so it stays small on typical trees. A zeroed slot is
+// empty since inode 0 is never a valid file.
+struct inode_key {
+    uint64_t dev;
+    uint64_t ino;
+};
+
+struct inode_set {
+    struct inode_key *slots;
+    size_t cap;
+    size_t used;
+};
+
+static size_t inode_hash(uint64_t dev, uint64_t ino) {
+    uint64_t h = ino ^ (dev * 0x9e3779b97f4a7c15ull);
+    h ^= h >> 31;
+    h *= 0xbf58476d1ce4e5b9ull;
+    h ^= h >> 29;
+    return (size_t)h;
+}
+
+// Returns 1 if (dev, ino) was newly added, 0 if it was already present
+static int inode_set_add(struct inode_set *set, uint64_t dev, uint64_t ino) {
+    if ((set->used + 1) * 2 > set->cap) {
+        size_t cap = set->cap ? set->cap * 2 : 64;
+        struct inode_key *slots = calloc(cap, sizeof(*slots));
+        if (!slots) return 1;   // count it rather than fail the listing
+        for (size_t i = 0; i < set->cap; i++) {
+            if (set->slots[i].ino == 0) continue;
+            size_t j = inode_hash(set->slots[i].dev, set->slots[i].ino) & (cap - 1);
+            while (slots[j].ino != 0) j = (j + 1) & (cap - 1);
+            slots[j] = set->slots[i];
+        }
+        free(set->slots);
+        set->slots = slots;
+        set->cap = cap;
+    }
+
+    size_t j = inode_hash(dev, ino) & (set->cap - 1);
+    while (set->slots[j].ino != 0) {
+        if (set->slots[j].ino == ino && set->slots[j].dev == dev) return 0;
+        j = (j + 1) & (set->cap - 1);
+    }
+    set->slots[j].dev = dev;
+    set->slots[j].ino = ino;
+    set->used++;
+    return 1;
+}
+
+// ----- Parallel tree scan for du -----
+
+// One directory of a fully scanned tree
+struct dir_node {
+    char *path;
+    struct listing l;
+    int ok;
+    long long self_blocks;   // st_blocks of the directory inode itself
+    long long blocks;        // subtree usage in 512-byte blocks
+    int depth;               // levels below the root
+    struct dir_node **children;
+    int nchildren;
+};
+
+// Work queue shared by the scanning threads
+struct scan_queue {
+    const struct ls_context *ctx;
+    dev_t root_dev;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct dir_node **items;
+    int len;
+    int cap;
+    int pending;   // nodes queued or being scanned
+};
+
+static struct dir_node *new_dir_node(const char *path, long long self_blocks) {
+    struct dir_node *node = calloc(1, sizeof(*node));
+    if (!node) return NULL;
+    node->path = strdup(path);
+    if (!node->path) { free(node); return NULL; }
+    node->self_blocks = self_blocks;
+    return node;
+}
+
+// Read one directory and create (but do not scan) a child node per subdirectory
+static void scan_dir_node(const struct scan_queue *q, struct dir_node *node) {
+    const struct ls_context *ctx = q->ctx;
+    struct walk w = { q->root_dev, node->depth };
+    node->ok = load_listing(ctx, node->path, &node->l) == 0;
+    if (!node->ok) return;
+
+    const struct listing *l = &node->l;
+    // Records outside the display order (entries that could not be
+    // stat'ed) have no metadata, so only the order is walked
+    int ndirs = 0;
+    for (int p = 0; p < l->count; p++) {
+        uint32_t i = l->order[p];
+        if (S_ISDIR(l->mode[i]) && !is_dot_or_dotdot(entry_name(l, i))) ndirs++;
+    }
+    if (ndirs == 0) return;
+
+    node->children = malloc(ndirs * sizeof(struct dir_node *));
+    if (!node->children) return;
+    for (int p = 0; p < l->count; p++) {
+        uint32_t i = l->order[p];
+        if (!S_ISDIR(l->mode[i]) || is_dot_or_dotdot(entry_name(l, i))) continue;
+        char fullpath[4096];
+        snprintf(fullpath, sizeof(fullpath), "%s/%s", node->path, entry_name(l, i));
+        if (!walk_enters(ctx, &w, fullpath, entry_name(l, i))) continue;
+        struct dir_node *child = new_dir_node(fullpath, l->blocks[i]);
+        if (!child) continue;
+        child->depth = node->depth + 1;
+        node->children[node->nchildren++] = child;
+    }
+}
+
+static void *scan_worker(void *arg) {
+    struct scan_queue *q = arg;
+
+    pthread_mutex_lock(&q->lock);
+    for (;;) {
+        while (q->len == 0 && q->pending > 0)
+            pthread_cond_wait(&q->cond, &q->lock);
+        if (q->len == 0) break;
+
+        struct dir_node *node = q->items[--q->len];
+        pthread_mutex_unlock(&q->lock);
+
+        scan_dir_node(q, node);
+
+        pthread_mutex_lock(&q->lock);
+        if (q->len + node->nchildren > q->cap) {
+            int cap = q->cap * 2;
+            while (cap < q->len + node->nchildren) cap *= 2;
+            struct dir_node **tmp = realloc(q->items, cap * sizeof(*tmp));
+            if (tmp) { q->items = tmp; q->cap = cap; }
+        }
+        // Children that do not fit stay unscanned and are reported empty
+        for (int i = node->nchildren - 1; i >= 0 && q->len < q->cap; i--) {
+            q->items[q->len++] = node->children[i];
+            q->pending++;
+        }
+        q->pending--;
+        pthread_cond_broadcast(&q->cond);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return NULL;
+}
+
+// Scan a whole tree, spreading subdirectories across worker threads
+static struct dir_node *scan_tree(const struct ls_context *ctx, const char *root) {
+    struct stat st;
+    if (stat(root, &st) == -1) { perror(root); return NULL; }
+    struct dir_node *node = new_dir_node(root, st.st_blocks);
+    if (!node) return NULL;
+
+    struct scan_queue q;
+    q.ctx = ctx;
+    q.root_dev = st.st_dev;
+    pthread_mutex_init(&q.lock, NULL);
+    pthread_cond_init(&q.cond, NULL);
+    q.cap = 64;
+    q.items = malloc(q.cap * sizeof(*q.items));
+    if (!q.items) { scan_dir_node(&q, node); return node; }
+    q.items[0] = node;
+    q.len = 1;
+    q.pending = 1;
+
+    int nthreads = worker_count();
+    pthread_t *threads = malloc((nthreads - 1) * sizeof(pthread_t));
+    int started = 0;
+    for (int i = 0; threads && i < nthreads - 1; i++) {
+        if (pthread_create(&threads[i], NULL, scan_worker, &q) != 0) break;
+        started++;
+    }
+    scan_worker(&q);
+    for (int i = 0; i < started; i++) pthread_join(threads[i], NULL);
+
+    free(threads);
+    free(q.items);
+    pthread_cond_destroy(&q.cond);
+    pthread_mutex_destroy(&q.lock);
+    return node;
+}
+
+// Sum subtree usage from the scanned stat results, counting every
+// multiply-linked inode once.
+static long long du_accumulate(struct dir_node *node, struct inode_set *seen) {
+    long long sum = node->self_blocks;
+    if (node->ok) {
+        const struct listing *l = &node->l;
+        for (int p = 0; p < l->count; p++) {
+            uint32_t i = l->order[p];
+            if (S_ISDIR(l->mode[i])) continue;   // counted by the child node
+            if (l->nlink[i] > 1 && !inode_set_add(seen, l->dev, l->ino[i])) continue;
+            sum += l->blocks[i];
+        }
+    }
+    for (int i = 0; i < node->nchildren; i++) sum += du_accumulate(node->children[i], seen);
+    node->blocks = sum;
+    return sum;
+}
+
+// du-style summary: one line per directory, children before parents
+static void print_du(struct ls_out *out, const struct dir_node *node) {
+    for (int i = 0; i < node->nchildren; i++) print_du(out, node->children[i]);
+    out_printf(out, "%lld\t%s\n", (node->blocks + 1) / 2, node->path);
+}
+
+// Print a scanned tree in the same order and format as do_ls()
+static void print_tree(struct ls_context *ctx, struct ls_out *out, struct dir_node *node) {
+    if (!node->ok) return;
+    if (ctx->opts.recursive) out_printf(out, "%s:\n", node->path);
+    node->l.dir = node->path;
+    display_listing(ctx, out, &node->l);
+    if (!ctx->opts.recursive) return;
+    for (int i = 0; i < node->nchildren; i++) {
+        out_printf(out, "\n");
+        print_tree(ctx, out, node->children[i]);
+    }
+}
+
+static void free_tree(struct dir_node *node) {
+    for (int i = 0; i < node->nchildren; i++) free_tree(node->children[i]);
+    if (node->ok) free_listing(&node->l);
+    free(node->children);
+    free(node->path);
+    free(node);
+}
+
+// Scan the tree once in parallel, print the listing from the gathered
+// records, then the per-directory usage summary.
+int ls_du(struct ls_context *ctx, const char *dirname, FILE *fp) {
+    struct ls_out out = { fp, NULL, 0, 0 };
+    struct dir_node *root = scan_tree(ctx, dirname);
+    if (!root) return 2;
+
+    print_tree(ctx, &out, root);
+
+    struct inode_set seen = {0};
+    du_accumulate(root, &seen);
+    free(seen.slots);
+    out_printf(&out, "\n");
+    print_du(&out, root);
+
+    free_tree(root);
+    return 0;
+}
+
+// ----- Snapshots and diffs -----
+// A snapshot is the tree's sorted listings flattened depth-first: each
+// entry as a spill record named by its path below the root, directories
+// followed by their full-precision mtime and then their own entries.
+// Paths compare component by component in that order, so a diff is one
+// linear merge of the snapshot stream against a fresh walk of the tree.
+#define SNAP_MAGIC   0x4e53594du  /* "MYSN" */
+#define SNAP_VERSION 2
+
+struct snap_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t filter_sig;
+    uint64_t walk_sig;       // --max-depth, --one-file-system and --prune
+    int64_t root_mtime;
+};
+
+// FNV-1a over the pruning settings, which decide how much of the tree
+// a snapshot covers
+static uint64_t walk_sig(const struct ls_context *ctx) {
+    uint64_t h = 0xcbf29ce484222325ull;
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%d:%d", ctx->opts.max_depth, ctx->opts.one_file_system);
+    for (const char *c = buf; *c; c++) h = (h ^ (unsigned char)*c) * 0x100000001b3ull;
+    for (int i = 0; i < ctx->filter.nprune; i++) {
+        const struct pattern *p = ctx->filter.prune[i];
+        h = (h ^ (p->kind == PAT_REGEX ? 'r' : 'g')) * 0x100000001b3ull;
+        for (const char *c = p->source; *c; c++) h = (h ^ (unsigned char)*c) * 0x100000001b3ull;
+        h = (h ^ 0) * 0x100000001b3ull;
+    }
+    return h;
+}
+
+// walk_enters() for a directory given by its path below the root
+static int walk_enters_rel(const struct ls_context *ctx, dev_t root_dev,
+                           const char *fullpath, const char *relpath) {
+    struct walk w = { root_dev, 0 };
+    const char *name = relpath;
+    for (const char *c = relpath; *c; c++)
+        if (*c == '/') { w.depth++; name = c + 1; }
+    return walk_enters(ctx, &w, fullpath, name);
+}
+
+static int64_t mtime_ns(const struct stat *st) {
+    return (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+}
+
+static void join_path(char *buf, size_t len, const char *dir, const char *name) {
+    if (*dir) snprintf(buf, len, "%s/%s", dir, name);
+    else snprintf(buf, len, "%s", name);
+}
+
+// Directory records are followed by the directory's mtime stamp, except
+// for . and .. (with -a), which are never descended into
+static int snap_has_stamp(mode_t mode, const char *name) {
+    return S_ISDIR(mode) && !is_dot_or_dotdot(name);
+}
+
+static int write_snapshot_dir(struct ls_context *ctx, FILE *fp, const char *dirname, const char *rel,
+                              dev_t root_dev) {
+    struct listing l;
+    if (load_listing(ctx, dirname, &l) == -1) return -1;
+
+    int ok = 1;
+    for (int p = 0; ok && p < l.count; p++) {
+        uint32_t i = l.order[p];
+        const char *name = entry_name(&l, i);
+        char fullpath[1024], relpath[1024];
+        snprintf(fullpath, sizeof(fullpath), "%s/%s", dirname, name);
+        join_path(relpath, sizeof(relpath), rel, name);
+
+        ok = write_spill_record(fp, &l, i, relpath);
+        if (!ok || !snap_has_stamp(l.mode[i], name)) continue;
+        // The stamp is taken before the directory is read, so a change
+        // made while it is being read still counts as a change next time
+        struct stat st;
+        int64_t stamp = stat(fullpath, &st) == 0 ? mtime_ns(&st) : -1;
+        ok = fwrite(&stamp, sizeof(stamp), 1, fp) == 1;
+        if (ok && walk_enters_rel(ctx, root_dev, fullpath, relpath))
+            write_snapshot_dir(ctx, fp, fullpath, relpath, root_dev);
+    }
+    free_listing(&l);
+    return ok ? 0 : -1;
+}
+
+// Write a snapshot of the tree at path. Like the cache, the file is
+// written under a temporary name and renamed into place.
+int ls_snapshot(struct ls_context *ctx, const char *path, const char *file) {
+    struct stat st;
+    if (stat(path, &st) == -1) { perror(path); return 2; }
+
+    char tmp[1100];
+    snprintf(tmp, sizeof(tmp), "%s.%ld", file, (long)getpid());
+    FILE *fp = fopen(tmp, "wb");
+    if (!fp) { perror(tmp); return 2; }
+
+    struct snap_header h = { SNAP_MAGIC, SNAP_VERSION, ctx->filter.sig, walk_sig(ctx), mtime_ns(&st) };
+    int ok = fwrite(&h, sizeof(h), 1, fp) == 1 && write_snapshot_dir(ctx, fp, path, "", st.st_dev) == 0;
+    if (fclose(fp) != 0) ok = 0;
+    if (!ok || rename(tmp, file) == -1) {
+        perror(file);
+        unlink(tmp);
+        return 2;
+    }
+    return 0;
+}
+
+static void print_change(struct ls_context *ctx, struct ls_out *out, char tag,
+                         const struct listing *l, uint32_t i);
+
+struct diff_state {
+    struct ls_context *ctx;
+    struct ls_out *out;
+    dev_t root_dev;
+    struct run_reader snap;     // current snapshot record, if have
+    int have;
+    int64_t stamp;              // its mtime, when it is a directory
+    struct listing row;         // scratch record for reporting new entries
+    int changes;
+    int errors;
+};
+
+static void snap_next(struct diff_state *ds) {
+    ds->have = read_spill_record(&ds->snap);
+    const char *path = ds->have == 1 ? entry_name(&ds->snap.l, 0) : NULL;
+    const char *slash = path ? strrchr(path, '/') : NULL;
+    if (ds->have == 1 && snap_has_stamp(ds->snap.l.mode[0], slash ? slash + 1 : path) &&
+        fread(&ds->stamp, sizeof(ds->stamp), 1, ds->snap.fp) != 1)
+        ds->have = -1;
+    if (ds->have == -1) {
+        ds->have = 0;
+        ds->errors++;
+    }
+}
+
+// Name of the current snapshot record if it sits directly in rel
+static const char *snap_child(const struct diff_state *ds, const char *rel) {
+    if (!ds->have) return NULL;
+    const char *path = entry_name(&ds->snap.l, 0);
+    size_t len = strlen(rel);
+    if (len == 0) return path;
+    return strncmp(path, rel, len) == 0 && path[len] == '/' ? path + len + 1 : NULL;
+}
+
+static void report(struct diff_state *ds, char tag, const struct listing *l, uint32_t i) {
+    print_change(ds->ctx, ds->out, tag, l, i);
+    ds->changes++;
+}
+
+// Report an entry of the current tree under its path below the root
+static void report_new(struct diff_state *ds, char tag, const struct listing *l, uint32_t i,
+                       const char *relpath) {
+    ds->row.count = ds->row.nrec = 0;
+    ds->row.names_len = 0;
+    if (listing_add(&ds->row, relpath) != 0) { ds->errors++; return; }
+    ds->row.mode[0] = l->mode[i];
+    ds->row.nlink[0] = l->nlink[i];
+    ds->row.uid[0] = l->uid[i];
+    ds->row.gid[0] = l->gid[i];
+    ds->row.ino[0] = l->ino[i];
+    ds->row.size[0] = l->size[i];
+    ds->row.blocks[0] = l->blocks[i];
+    ds->row.mtime[0] = l->mtime[i];
+    report(ds, tag, &ds->row, 0);
+}
+
+// Directories count as modified only for their own attributes; their
+// size, link count and mtime follow from the entries reported below them.
+static int entry_modified(const struct listing *a, uint32_t i, const struct listing *b, uint32_t j) {
+    if (a->mode[i] != b->mode[j] || a->uid[i] != b->uid[j] || a->gid[i] != b->gid[j] ||
+        a->ino[i] != b->ino[j])
+        return 1;
+    if (S_ISDIR(a->mode[i])) return 0;
+    return a->size[i] != b->size[j] || a->mtime[i] != b->mtime[j] || a->nlink[i] != b->nlink[j];
+}
+
+// Consume the records below a directory, reporting them as removed
+static void snap_skip_below(struct diff_state *ds, const char *path, int quiet) {
+    char prefix[1024];
+    int len = snprintf(prefix, sizeof(prefix), "%s/", path);
+    while (ds->have && strncmp(entry_name(&ds->snap.l, 0), prefix, len) == 0) {
+        if (!quiet) report(ds, '-', &ds->snap.l, 0);
+        snap_next(ds);
+    }
+}
+
+// Consume the current record and everything below it
+static void snap_skip(struct diff_state *ds, int quiet) {
+    char path[1024];
+    snprintf(path, sizeof(path), "%s", entry_name(&ds->snap.l, 0));
+    if (!quiet) report(ds, '-', &ds->snap.l, 0);
+    snap_next(ds);
+    snap_skip_below(ds, path, quiet);
+}
+
+static void report_added(struct diff_state *ds, const char *dirname, const char *rel) {
+    struct listing l;
+    if (load_listing(ds->ctx, dirname, &l) == -1) { ds->errors++; return; }
+    for (int p = 0; p < l.count; p++) {
+        uint32_t i = l.order[p];
+        const char *name = entry_name(&l, i);
+        char fullpath[1024], relpath[1024];
+        snprintf(fullpath, sizeof(fullpath), "%s/%s", dirname, name);
+        join_path(relpath, sizeof(relpath), rel, name);
+        report_new(ds, '+', &l, i, relpath);
+        if (S_ISDIR(l.mode[i]) && !is_dot_or_dotdot(name) &&
+            walk_enters_rel(ds->ctx, ds->root_dev, fullpath, relpath))
+            report_added(ds, fullpath, relpath);
+    }
+    free_listing(&l);
+}
+
+static void diff_dir(struct diff_state *ds, const char *dirname, const char *rel, int unchanged);
+
+// Compare entry i of the current tree with the matching snapshot record
+// (already consumed into old) and descend if it is a directory.
+static void diff_matched(struct diff_state *ds, const struct listing *l, uint32_t i,
+                         const struct listing *old, int64_t old_stamp,
+                         const char *fullpath, const char *relpath) {
+    int was_dir = S_ISDIR(old->mode[0]);
+    if (entry_modified(old, 0, l, i)) report_new(ds, '~', l, i, relpath);
+    if (is_dot_or_dotdot(entry_name(l, i))) return;
+
+    if (S_ISDIR(l->mode[i])) {
+        struct stat st;
+        if (!walk_enters_rel(ds->ctx, ds->root_dev, fullpath, relpath)) return;
+        if (!was_dir) report_added(ds, fullpath, relpath);
+        else if (stat(fullpath, &st) == -1) ds->errors++;
+        else diff_dir(ds, fullpath, relpath, mtime_ns(&st) == old_stamp);
+    } else if (was_dir) {
+        // Replaced by a file: whatever was below it is gone
+        snap_skip_below(ds, relpath, 0);
+    }
+}
+
+// Take the current snapshot record out of the stream for diff_matched()
+static int64_t snap_take(struct diff_state *ds, struct listing *old) {
+    int64_t stamp = ds->stamp;
+    if (listing_copy(old, &ds->snap.l) == -1) ds->errors++;
+    snap_next(ds);
+    return stamp;
+}
+
+// A directory whose mtime has not moved still holds exactly the names
+// recorded for it, so they are taken from the snapshot instead of
+// being read and sorted again. Entries are still stat'ed: writing to a
+// file does not touch its directory's mtime.
+static void diff_known_dir(struct diff_state *ds, const char *dirname, const char *rel) {
+    int dfd = open(dirname, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dfd == -1) { perror(dirname); ds->errors++; return; }
+
+    const char *name;
+    struct listing cur = {0};
+    while ((name = snap_child(ds, rel)) != NULL) {
+        struct stat st;
+        char fullpath[1024], relpath[1024];
+        snprintf(fullpath, sizeof(fullpath), "%s/%s", dirname, name);
+        snprintf(relpath, sizeof(relpath), "%s", entry_name(&ds->snap.l, 0));
+        if (fstatat(dfd, name, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+            snap_skip(ds, 0);
+            continue;
+        }
+
+        cur.count = cur.nrec = 0;
+        cur.names_len = 0;
+        if (listing_add(&cur, name) != 0) { ds->errors++; break; }
+        set_entry_stat(&cur, 0, &st);
+        struct listing old;
+        int64_t stamp = snap_take(ds, &old);
+        diff_matched(ds, &cur, 0, &old, stamp, fullpath, relpath);
+        free_listing(&old);
+    }
+    free_listing(&cur);
+    close(dfd);
+}
+
+static void diff_dir(struct diff_state *ds, const char *dirname, const char *rel, int unchanged) {
+    if (unchanged) {
+        diff_known_dir(ds, dirname, rel);
+        return;
+    }
+
+    struct listing l;
+    if (load_listing(ds->ctx, dirname, &l) == -1) {
+        // Unreadable: leave what was recorded below it unreported
+        ds->errors++;
+        while (snap_child(ds, rel)) snap_skip(ds, 1);
+        return;
+    }
+
+    const char *old_name;
+    for (int p = 0; p < l.count; p++) {
+        uint32_t i = l.order[p];
+        const char *name = entry_name(&l, i);
+        char fullpath[1024], relpath[1024];
+        snprintf(fullpath, sizeof(fullpath), "%s/%s", dirname, name);
+        join_path(relpath, sizeof(relpath), rel, name);
+
+        int cmp = 1;
+        while ((old_name = snap_child(ds, rel)) != NULL && (cmp = strcmp(old_name, name)) < 0)
+            snap_skip(ds, 0);
+        if (old_name && cmp == 0) {
+            struct listing old;
+            int64_t stamp = snap_take(ds, &old);
+            diff_matched(ds, &l, i, &old, stamp, fullpath, relpath);
+            free_listing(&old);
+        } else {
+            report_new(ds, '+', &l, i, relpath);
+            if (S_ISDIR(l.mode[i]) && !is_dot_or_dotdot(name) &&
+                walk_enters_rel(ds->ctx, ds->root_dev, fullpath, relpath))
+                report_added(ds, fullpath, relpath);
+        }
+    }
+    while (snap_child(ds, rel)) snap_skip(ds, 0);
+    free_listing(&l);
+}
+
+// Report what changed in the tree at path since a snapshot was written.
+// Returns 0 when nothing changed, 1 when something did, 2 on errors.
+int ls_diff(struct ls_context *ctx, const char *path, const char *file, FILE *fp) {
+    struct ls_out out = { fp, NULL, 0, 0 };
+    struct diff_state ds = { .ctx = ctx, .out = &out };
+    struct snap_header h;
+    struct stat st;
+
+    ds.snap.fp = fopen(file, "rb");
+    if (!ds.snap.fp) { perror(file); return 2; }
+    if (fread(&h, sizeof(h), 1, ds.snap.fp) != 1 || h.magic != SNAP_MAGIC || h.version != SNAP_VERSION) {
+        fprintf(stderr, "%s: not a snapshot file\n", file);
+        fclose(ds.snap.fp);
+        return 2;
+    }
+    if (h.filter_sig != ctx->filter.sig || h.walk_sig != walk_sig(ctx)) {
+        fprintf(stderr, "%s: snapshot was taken with different -a/-A, name filters or pruning\n", file);
+        fclose(ds.snap.fp);
+        return 2;
+    }
+    if (stat(path, &st) == -1) { perror(path); fclose(ds.snap.fp); return 2; }
+
+    // Reported names are paths below the root
+    ds.snap.l.dir = ds.row.dir = path;
+    ds.root_dev = st.st_dev;
+    snap_next(&ds);
+    diff_dir(&ds, path, "", mtime_ns(&st) == h.root_mtime);
+
+    fclose(ds.snap.fp);
+    free_listing(&ds.snap.l);
+    free_listing(&ds.row);
+    if (ds.errors) return 2;
+    return ds.changes ? 1 : 0;
+}
+
+// ----- Multiple operands -----
+
+// One command-line path. Directory operands are scanned by the pool
+// and printed by the calling thread in sorted operand order.
+struct operand {
+    const char *path;
+    struct stat st;
+    int done;
+    int ok;
+    struct listing l;
+};
+
+struct operand_pool {
+    const struct ls_context *ctx;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct operand *ops;
+    int n;
+    int next;
+};
+
+static void *operand_worker(void *arg) {
+    struct operand_pool *pool = arg;
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        int idx = pool->next++;
+        pthread_mutex_unlock(&pool->lock);
+        if (idx >= pool->n) break;
+
+        struct operand *op = &pool->ops[idx];
+        int ok = load_listing(pool->ctx, op->path, &op->l) == 0;
+
+        pthread_mutex_lock(&pool->lock);
+        op->ok = ok;
+        op->done = 1;
+        pthread_cond_broadcast(&pool->cond);
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return NULL;
+}
+
+static int operand_cmp(const void *a, const void *b) {
+    return strcmp(((const struct operand *)a)->path, ((const struct operand *)b)->path);
+}
+
+// List every operand as GNU ls does: non-directories first as one
+// group, then each directory under a header. Returns the exit status.
+int ls_list_paths(struct ls_context *ctx, char **paths, int npaths, FILE *fp) {
+    struct ls_out out = { fp, NULL, 0, 0 };
+    struct operand *dirs = calloc(npaths, sizeof(struct operand));
+    struct listing files = {0};
+    if (!dirs) { perror("calloc"); return 2; }
+
+    int ndirs = 0, status = 0;
+    for (int i = 0; i < npaths; i++) {
+        struct stat st;
+        // Symlink operands are followed, except in -l where the link is shown
+        int rc = ctx->opts.long_format ? lstat(paths[i], &st) : stat(paths[i], &st);
+        if (rc == -1) {
+            fprintf(stderr, "ls: cannot access '%s': %s\n", paths[i], strerror(errno));
+            status = 2;
+            continue;
+        }
+        if (S_ISDIR(st.st_mode)) {
+            dirs[ndirs].path = paths[i];
+            dirs[ndirs].st = st;
+            ndirs++;
+        } else {
+            int j = listing_add(&files, paths[i]);
+            if (j == -1) { perror("listing_add"); status = 2; continue; }
+            set_entry_stat(&files, j, &st);
+        }
+    }
+    sort_order(&files, cmpfunc);
+    if (ndirs > 1) qsort(dirs, ndirs, sizeof(struct operand), operand_cmp);
+
+    struct operand_pool pool;
+    pool.ctx = ctx;
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.cond, NULL);
+    pool.ops = dirs;
+    pool.next = 0;
+
+    // Under a memory limit or with --stream, directories are listed one
+    // at a time as they are read instead of being loaded side by side.
+    int sequential = ctx->opts.memory_limit > 0 || streaming(ctx);
+    pool.n = sequential ? 0 : ndirs;
+
+    int nthreads = worker_count();
+    if (nthreads > pool.n) nthreads = pool.n;
+    pthread_t *threads = malloc((nthreads ? nthreads : 1) * sizeof(pthread_t));
+    int started = 0;
+    for (int i = 0; threads && i < nthreads; i++) {
+        if (pthread_create(&threads[i], NULL, operand_worker, &pool) != 0) break;
+        started++;
+    }
+    if (started == 0) operand_worker(&pool);
+
+    int need_blank = files.count > 0;
+    if (files.count > 0) print_entries(ctx, &out, &files);
+    free_listing(&files);
+
+    int header = npaths > 1 || ctx->opts.recursive;
+    for (int i = 0; i < ndirs; i++) {
+        struct operand *op = &dirs[i];
+        struct walk w = { op->st.st_dev, 0 };
+        if (sequential) {
+            if (need_blank) out_printf(&out, "\n");
+            int rc = ctx->opts.memory_limit ? list_budgeted(ctx, &out, op->path, header, &w)
+                                            : list_streamed(ctx, &out, op->path, header, &w);
+            if (rc == -1) status = 2;
+            need_blank = 1;
+            continue;
+        }
+
+        pthread_mutex_lock(&pool.lock);
+        while (!op->done) pthread_cond_wait(&pool.cond, &pool.lock);
+        pthread_mutex_unlock(&pool.lock);
+
+        if (!op->ok) { status = 2; continue; }
+        if (need_blank) out_printf(&out, "\n");
+        show_listing(ctx, &out, op->path, &op->l, header, &w);
+        free_listing(&op->l);
+        need_blank = 1;
+    }
+
+    for (int i = 0; i < started; i++) pthread_join(threads[i], NULL);
+    free(threads);
+    pthread_cond_destroy(&pool.cond);
+    pthread_mutex_destroy(&pool.lock);
+    free(dirs);
+    return status;
+}
+
+// ----- Watch mode -----
+
+// Binary search of the display order by name. Returns the position of
+// the entry, or -(insertion point) - 1 when the name is not present.
+static int find_entry(const struct listing *l, const char *name) {
+    int lo = 0, hi = l->count - 1;
+    while (lo <= hi) {
+        int mid = lo + (hi - lo) / 2;
+        int c = strcmp(entry_name(l, l->order[mid]), name);
+        if (c == 0) return mid;
+        if (c < 0) lo = mid + 1;
+        else hi = mid - 1;
+    }
+    return -lo - 1;
+}
+
+// Render a single changed row, tagged '+' (added), '-' (removed) or '~' (changed)
+static void print_change(struct ls_context *ctx, struct ls_out *out, char tag,
+                         const struct listing *l, uint32_t i) {
+    out_printf(out, "%c ", tag);
+    if (ctx->opts.long_format) {
+        struct link_targets links;
+        link_targets_init(&links, S_ISLNK(l->mode[i]) ? open_link_dir(l) : AT_FDCWD);
+        print_long_row(ctx, out, l, i, 1, &links);
+        link_targets_free(&links);
+        if (links.dfd >= 0) close(links.dfd);
+    } else {
+        print_colored(out, entry_name(l, i), l->mode[i]);
+        out_printf(out, "\n");
+    }
+}
+
+// Drop a row from the display order. Its record stays behind until
+// enough have piled up to be worth a compaction.
+static void watch_remove(struct ls_context *ctx, struct ls_out *out, struct listing *l, const char *name) {
+    int pos = find_entry(l, name);
+    if (pos < 0) return;
+    print_change(ctx, out, '-', l, l->order[pos]);
+    memmove(&l->order[pos], &l->order[pos + 1], (l->count - pos - 1) * sizeof(uint32_t));
+    l->count--;
+    if (l->nrec - l->count > l->count + 1024) listing_compact(l);
+}
+
+// Re-stat one name and insert or update its entry in sorted position
+static void watch_update(struct ls_context *ctx, struct ls_out *out, struct listing *l,
+                         const char *dirname, const char *name) {
+    char fullpath[1024];
+    struct stat st;
+    snprintf(fullpath, sizeof(fullpath), "%s/%s", dirname, name);
+    if (lstat(fullpath, &st) == -1) {
+        watch_remove(ctx, out, l, name);
+        return;
+    }
+
+    int pos = find_entry(l, name);
+    if (pos >= 0) {
+        // A single create usually also raises IN_ATTRIB/IN_CLOSE_WRITE;
+        // only re-render when something shown in the row changed.
+        uint32_t i = l->order[pos];
+        if (l->mode[i] == (uint16_t)st.st_mode && l->nlink[i] == st.st_nlink &&
+            l->uid[i] == st.st_uid && l->gid[i] == st.st_gid &&
+            l->size[i] == (uint64_t)st.st_size && l->mtime[i] == st.st_mtime)
+            return;
+        set_entry_stat(l, i, &st);
+        print_change(ctx, out, '~', l, i);
+        return;
+    }
+
+    // listing_add() appends to the order; move the new row into place
+    pos = -pos - 1;
+    int i = listing_add(l, name);
+    if (i == -1) { perror("listing_add"); return; }
+    set_entry_stat(l, i, &st);
+    memmove(&l->order[pos + 1], &l->order[pos], (l->count - 1 - pos) * sizeof(uint32_t));
+    l->order[pos] = i;
+    print_change(ctx, out, '+', l, i);
+}
+
+// List a directory once, then apply inotify events to the in-memory
+// listing and print only the rows that changed.
+int ls_watch(struct ls_context *ctx, const char *dirname, FILE *fp) {
+    struct ls_out out = { fp, NULL, 0, 0 };
+    int ifd = inotify_init1(IN_CLOEXEC);
+    if (ifd == -1) { perror("inotify_init1"); return 2; }
+
+    // Add the watch before the initial scan so no event is missed
+    uint32_t mask = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO |
+                    IN_ATTRIB | IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF;
+    if (inotify_add_watch(ifd, dirname, mask) == -1) {
+        perror(dirname);
+        close(ifd);
+        return 2;
+    }
+    // No directory fd is held open: it would keep a removed directory's
+    // inode alive and IN_DELETE_SELF would never arrive.
+    struct listing l;
+    if (load_listing(ctx, dirname, &l) == -1) {
+        close(ifd);
+        return 2;
+    }
+    // A listing mapped from the cache is read-only; take a private copy
+    if (l.cache_map && listing_compact(&l) == -1) {
+        free_listing(&l);
+        close(ifd);
+        return 2;
+    }
+    l.dir = dirname;
+    display_listing(ctx, &out, &l);
+    fflush(fp);
+
+    char buf[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int done = 0;
+    while (!done) {
+        ssize_t n = read(ifd, buf, sizeof(buf));
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            perror("read");
+            break;
+        }
+        for (char *p = buf; p < buf + n; ) {
+            struct inotify_event *ev = (struct inotify_event *)p;
+            p += sizeof(struct inotify_event) + ev->len;
+
+            if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+                done = 1;
+                break;
+            }
+            if (ev->mask & IN_Q_OVERFLOW) {
+                // Events were lost: fall back to one full rescan
+                free_listing(&l);
+                if (load_listing(ctx, dirname, &l) == -1) {
+                    close(ifd);
+                    return 2;
+                }
+                if (l.cache_map && listing_compact(&l) == -1) {
+                    free_listing(&l);
+                    close(ifd);
+                    return 2;
+                }
+                l.dir = dirname;
+                out_printf(&out, "\n");
+                display_listing(ctx, &out, &l);
+                continue;
+            }
+            if (ev->len == 0 || !name_wanted(ctx, ev->name)) continue;
+
+            if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) watch_remove(ctx, &out, &l, ev->name);
+            else watch_update(ctx, &out, &l, dirname, ev->name);
+        }
+        fflush(fp);
+    }
+
+    free_listing(&l);
+    close(ifd);
+    return 0;
+}
+
+// ----- Print Permissions (long listing) -----
+static void print_permissions(struct ls_out *out, mode_t mode) {
+    char perms[11] = "----------";
+    if (S_ISDIR(mode)) perms[0] = 'd';
+    if (S_ISLNK(mode)) perms[0] = 'l';
+    if (S_ISCHR(mode)) perms[0] = 'c';
+    if (S_ISBLK(mode)) perms[0] = 'b';
+    if (S_ISFIFO(mode)) perms[0] = 'p';
+    if (S_ISSOCK(mode)) perms[0] = 's';
+
+    if (mode & S_IRUSR) perms[1] = 'r';
+    if (mode & S_IWUSR) perms[2] = 'w';
+    if (mode & S_IXUSR) perms[3] = 'x';
+    if (mode & S_IRGRP) perms[4] = 'r';
+    if (mode & S_IWGRP) perms[5] = 'w';
+    if (mode & S_IXGRP) perms[6] = 'x';
+    if (mode & S_IROTH) perms[7] = 'r';
+    if (mode & S_IWOTH) perms[8] = 'w';
+    if (mode & S_IXOTH) perms[9] = 'x';
+    out_printf(out, "%s ", perms);
+}
+
+// ----- Determine Color and Print -----
+static void print_colored(struct ls_out *out, const char *filename, mode_t mode) {
+    if (S_ISDIR(mode)) out_printf(out, COLOR_BLUE "%s" COLOR_RESET, filename);
+    else if (S_ISLNK(mode)) out_printf(out, COLOR_MAGENTA "%s" COLOR_RESET, filename);
+    else if (S_ISREG(mode) && (mode & S_IXUSR)) out_printf(out, COLOR_GREEN "%s" COLOR_RESET, filename);
+    else if (strstr(filename, ".tar") || strstr(filename, ".gz") || strstr(filename, ".zip")) out_printf(out, COLOR_RED "%s" COLOR_RESET, filename);
+    else if (S_ISCHR(mode) || S_ISBLK(mode) || S_ISFIFO(mode) || S_ISSOCK(mode)) out_printf(out, COLOR_REVERSE "%s" COLOR_RESET, filename);
+    else out_printf(out, "%s", filename);
+}
+
+// ----- Symlink targets -----
+
+static size_t link_slot(const struct link_targets *lt, const char *text) {
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (const char *p = text; *p; p++) h = (h ^ (unsigned char)*p) * 0x100000001b3ull;
+    size_t i = h & (lt->cap - 1);
+    while (lt->slots[i].text && strcmp(lt->slots[i].text, text) != 0) i = (i + 1) & (lt->cap - 1);
+    return i;
+}
+
+static int link_targets_grow(struct link_targets *lt) {
+    size_t cap = lt->cap ? lt->cap * 2 : 64;
+    struct link_targets n = { lt->dfd, calloc(cap, sizeof(struct link_target)), cap, lt->used };
+    if (!n.slots) return -1;
+    for (size_t i = 0; i < lt->cap; i++)
+        if (lt->slots[i].text) n.slots[link_slot(&n, lt->slots[i].text)] = lt->slots[i];
+    free(lt->slots);
+    *lt = n;
+    return 0;
+}
+
+// Resolve what the link name (relative to lt->dfd) points at: its target
+// text into buf, and the type of the final target into *mode. Returns
+// 1 when the link is dangling, 0 when it resolves, -1 when unreadable.
+static int resolve_link(struct link_targets *lt, const char *name, char *buf, size_t len, mode_t *mode) {
+    ssize_t n = readlinkat(lt->dfd, name, buf, len - 1);
+    if (n == -1) return -1;
+    buf[n] = '\0';
+
+    // Relative targets resolve from the link's own directory, which is
+    // the listing's unless the name has a directory part of its own
+    int cacheable = buf[0] == '/' || !strchr(name, '/');
+    if (cacheable && lt->cap > 0) {
+        struct link_target *t = &lt->slots[link_slot(lt, buf)];
+        if (t->text) {
+            *mode = t->mode;
+            return t->dangling;
+        }
+    }
+
+    struct stat st;
+    int dangling = fstatat(lt->dfd, name, &st, 0) == -1;
+    *mode = dangling ? 0 : st.st_mode;
+    if (cacheable && ((lt->used + 1) * 2 <= lt->cap || link_targets_grow(lt) == 0)) {
+        struct link_target *t = &lt->slots[link_slot(lt, buf)];
+        t->text = strdup(buf);
+        if (t->text) {
+            t->mode = *mode;
+            t->dangling = dangling;
+            lt->used++;
+        }
+    }
+    return dangling;
+}
+
+// "name -> target" for -l, with dangling links marked in bold red
+static void print_link(struct ls_out *out, const char *name, struct link_targets *links) {
+    char target[4096];
+    mode_t mode;
+    int dangling = links->dfd == -1 ? -1 : resolve_link(links, name, target, sizeof(target), &mode);
+    if (dangling == -1) {
+        print_colored(out, name, S_IFLNK);
+    } else if (dangling) {
+        out_printf(out, COLOR_BROKEN "%s" COLOR_RESET " -> " COLOR_BROKEN "%s" COLOR_RESET, name, target);
+    } else {
+        print_colored(out, name, S_IFLNK);
+        out_printf(out, " -> ");
+        print_colored(out, target, mode);
+    }
+}
+
+// ----- Print Long Listing -----
+static void print_long_row(struct ls_context *ctx, struct ls_out *out, const struct listing *l,
+                           uint32_t i, int bw, struct link_targets *links) {
+    if (ctx->opts.size) out_printf(out, "%*lld ", bw, kblocks(l->blocks[i]));
+    print_permissions(out, l->mode[i]);
+    out_printf(out, "%2ld ", (long)l->nlink[i]);
+
+    char user[64], group[64];
+    lookup_id(ctx, 0, l->uid[i], user, sizeof(user));
+    lookup_id(ctx, 1, l->gid[i], group, sizeof(group));
+    out_printf(out, "%s %s ", user, group);
+
+    out_printf(out, "%5ld ", (long)l->size[i]);
+
+    char time_str[32];
+    time_t mtime = l->mtime[i];
+    ctime_r(&mtime, time_str);
+    time_str[strlen(time_str)-1] = '\0';
+    out_printf(out, "%s ", time_str);
+
+    if (S_ISLNK(l->mode[i])) print_link(out, entry_name(l, i), links);
+    else print_colored(out, entry_name(l, i), l->mode[i]);
+    out_printf(out, "\n");
+}
+
+static void print_long_format(struct ls_context *ctx, struct ls_out *out, const struct listing *l) {
+    int bw = ctx->opts.size ? blocks_width(l) : 0;
+    int dfd = AT_FDCWD;
+    for (int p = 0; p < l->count && dfd == AT_FDCWD; p++)
+        if (S_ISLNK(l->mode[l->order[p]])) dfd = open_link_dir(l);
+    struct link_targets links;
+    link_targets_init(&links, dfd);
+    for (int p = 0; p < l->count; p++) print_long_row(ctx, out, l, l->order[p], bw, &links);
+    link_targets_free(&links);
+    if (dfd >= 0) close(dfd);
+}
+
+// Rendering width: the caller's choice, else stdout's terminal, else 80
+static int term_width(const struct ls_context *ctx) {
+    struct winsize ws;
+    if (ctx->opts.term_width > 0) return ctx->opts.term_width;
+    return (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0) ? ws.ws_col : 80;
+}
+
+// ----- Print Down-Then-Across Columns -----
+static void print_down_then_across(struct ls_context *ctx, struct ls_out *out, const struct listing *l) {
+    int width = term_width(ctx);
+    int bw = ctx->opts.size ? blocks_width(l) : 0;
+    int prefix = ctx->opts.size ? bw + 1 : 0;
+    int col_width = l->max_len + 2 + prefix;
+    int num_cols = width / col_width;
+    if (num_cols < 1) num_cols = 1;
+    int num_rows = (l->count + num_cols - 1) / num_cols;
+
+    for (int r = 0; r < num_rows; r++) {
+        for (int c = 0; c < num_cols; c++) {
+            int pos = c * num_rows + r;
+            if (pos < l->count) {
+                uint32_t i = l->order[pos];
+                const char *name = entry_name(l, i);
+                if (ctx->opts.size) out_printf(out, "%*lld ", bw, kblocks(l->blocks[i]));
+                print_colored(out, name, l->mode[i]);
+                int padding = col_width - prefix - strlen(name);
+                out_printf(out, "%*s", padding, "");
+            }
+        }
+        out_printf(out, "\n");
+    }
+}
+
+// ----- Print Horizontal (-x) Columns -----
+static void print_horizontal(struct ls_context *ctx, struct ls_out *out, const struct listing *l) {
+    int bw = ctx->opts.size ? blocks_width(l) : 0;
+    int prefix = ctx->opts.size ? bw + 1 : 0;
+    int col_width = l->max_len + 2 + prefix;
+    int width = term_width(ctx);
+    int cur_width = 0;
+
+    for (int p = 0; p < l->count; p++)
+        print_horizontal_item(ctx, out, l, l->order[p], bw, width, col_width, &cur_width);
+    if (l->count > 0) out_printf(out, "\n");
+}
+
+// One cell of a horizontal listing, wrapping before it when the line is full
+static void print_horizontal_item(struct ls_context *ctx, struct ls_out *out, const struct listing *l,
+                                  uint32_t i, int bw, int width, int col_width, int *cur_width) {
+    int prefix = ctx->opts.size ? bw + 1 : 0;
+    const char *name = entry_name(l, i);
+    int len = strlen(name);
+    if (*cur_width + col_width > width && *cur_width > 0) { out_printf(out, "\n"); *cur_width = 0; }
+    if (ctx->opts.size) out_printf(out, "%*lld ", bw, kblocks(l->blocks[i]));
+    print_colored(out, name, l->mode[i]);
+    out_printf(out, "%*s", col_width - prefix - len, "");
+    *cur_width += col_width;
+}
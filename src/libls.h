@@ -0,0 +1,103 @@
+/*
+ * libls: embeddable directory listing library (Version 1.7.0)
+ * Author: BSDSF23M002
+ * Description: The scanning, caching, filtering and rendering code behind
+ *              bin/ls, usable in-process without a fork/exec per listing.
+ *
+ * A context holds the options together with state that is reused across
+ * calls (compiled name filters, uid/gid name caches, and with
+ * keep_listings recently listed directories). Scans do not share
+ * mutable state, so one context may serve several threads at once.
+ */
+
+#ifndef LIBLS_H
+#define LIBLS_H
+
+#include <stddef.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+// Which dot files are listed (-a / -A)
+enum { LS_SHOW_DEFAULT, LS_SHOW_ALMOST_ALL, LS_SHOW_ALL };
+
+// Flags for ls_add_filter()
+#define LS_FILTER_INCLUDE 0x0
+#define LS_FILTER_EXCLUDE 0x1
+#define LS_FILTER_REGEX   0x2
+#define LS_FILTER_PRUNE   0x4     // a directory -R, --du and snapshots do not enter
+
+struct ls_options {
+    int long_format;        // -l
+    int horizontal;         // -x
+    int recursive;          // -R
+    int size;               // -s
+    int show;               // LS_SHOW_*
+    int term_width;         // columns to render for; 0 asks stdout's terminal
+    size_t memory_limit;    // bytes for sorting; larger directories spill to disk. 0: no limit
+    int stream;             // -l rows as soon as their metadata arrives, total last
+    int max_depth;          // levels walks descend below an operand. 0: no limit
+    int one_file_system;    // walks stay on each operand's filesystem
+    // Both caches below are revalidated against the directory's mtime and
+    // ctime only, so entry metadata may be stale for files changed in place
+    const char *cache_dir;  // on-disk listing cache, NULL to disable
+    int keep_listings;      // directories kept in memory between calls. 0: none
+};
+
+// The lstat() fields a listing keeps per entry. Access and change times,
+// st_rdev and st_blksize are not kept, and times are whole seconds.
+struct ls_stat {
+    dev_t dev;
+    ino_t ino;
+    mode_t mode;
+    nlink_t nlink;          // saturates at UINT32_MAX
+    uid_t uid;
+    gid_t gid;
+    off_t size;
+    blkcnt_t blocks;        // 512-byte blocks
+    time_t mtime;
+};
+
+// One directory entry together with its metadata
+struct ls_entry {
+    char *name;
+    struct ls_stat st;
+};
+
+struct ls_context;
+struct ls_scan;
+
+// Returning non-zero from the callback stops ls_scan_foreach()
+typedef int (*ls_entry_cb)(const struct ls_entry *entry, void *arg);
+
+// ----- Context -----
+struct ls_context *ls_context_new(const struct ls_options *opts);
+int ls_add_filter(struct ls_context *ctx, int flags, const char *pattern);
+void ls_context_free(struct ls_context *ctx);
+
+// ----- Scans -----
+// A scan holds the sorted, filtered entries of one directory.
+struct ls_scan *ls_scan_open(struct ls_context *ctx, const char *path);
+const struct ls_entry *ls_scan_next(struct ls_scan *scan);
+size_t ls_scan_count(const struct ls_scan *scan);
+void ls_scan_close(struct ls_scan *scan);
+int ls_scan_foreach(struct ls_context *ctx, const char *path, ls_entry_cb cb, void *arg);
+
+// Render a scan as bin/ls would print it. Behaves like snprintf: the
+// result is truncated to len - 1 bytes and NUL-terminated, and the
+// return value is the full length needed.
+size_t ls_render(struct ls_context *ctx, const struct ls_scan *scan, char *buf, size_t len);
+
+// ----- Whole commands -----
+// Each returns an ls-style exit status (0, or 2 on errors).
+int ls_list_paths(struct ls_context *ctx, char **paths, int npaths, FILE *fp);
+int ls_du(struct ls_context *ctx, const char *path, FILE *fp);
+int ls_watch(struct ls_context *ctx, const char *path, FILE *fp);
+
+// Save the tree at path as a binary snapshot file, and later report
+// entries added (+), removed (-) or modified (~) since. ls_diff()
+// returns 0 when nothing changed, 1 when something did, 2 on errors.
+int ls_snapshot(struct ls_context *ctx, const char *path, const char *file);
+int ls_diff(struct ls_context *ctx, const char *path, const char *file, FILE *fp);
+
+#endif
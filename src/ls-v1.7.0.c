@@ -0,0 +1,535 @@
+/*
+ * Custom implementation of the 'ls' command (Version 1.7.0)
+ * Author: BSDSF23M002
+ * Description: Command-line front end. Parses options and hands the
+ *              listing itself to libls (see libls.h). With --serve it
+ *              stays resident as a listing daemon, and with --connect
+ *              it forwards the command line to one.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "libls.h"
+
+// Default cache location: $XDG_CACHE_HOME/myls or ~/.cache/myls
+static const char *default_cache_dir(void) {
+    static char buf[1024];
+    const char *xdg = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    if (xdg && *xdg) snprintf(buf, sizeof(buf), "%s/myls", xdg);
+    else if (home && *home) snprintf(buf, sizeof(buf), "%s/.cache/myls", home);
+    else return NULL;
+    return buf;
+}
+
+// Parse a byte count with an optional K, M or G suffix. Returns 0 on error.
+static size_t parse_size(const char *arg) {
+    char *end;
+    errno = 0;
+    unsigned long long n = strtoull(arg, &end, 10);
+    if (errno || end == arg) return 0;
+    switch (*end) {
+        case 'k': case 'K': n <<= 10; end++; break;
+        case 'm': case 'M': n <<= 20; end++; break;
+        case 'g': case 'G': n <<= 30; end++; break;
+    }
+    return *end ? 0 : (size_t)n;
+}
+
+enum {
+    OPT_CACHE = 256, OPT_WATCH, OPT_DU,
+    OPT_INCLUDE, OPT_EXCLUDE, OPT_INCLUDE_REGEX, OPT_EXCLUDE_REGEX,
+    OPT_MEMORY_LIMIT, OPT_SERVE, OPT_CONNECT, OPT_SNAPSHOT, OPT_DIFF, OPT_STREAM,
+    OPT_MAX_DEPTH, OPT_ONE_FILE_SYSTEM, OPT_PRUNE
+};
+
+// A filter from the command line, added once the context exists
+struct filter_arg {
+    int flags;
+    const char *pattern;
+};
+
+// One parsed command line
+struct command {
+    struct ls_options opts;
+    int watch_flag;
+    int du_flag;
+    struct filter_arg *filters;
+    int nfilters;
+    const char *serve;      // --serve: socket to listen on
+    const char *connect;    // --connect: daemon to forward to
+    const char *snapshot;   // --snapshot: file to save the tree to
+    const char *diff;       // --diff: snapshot to compare the tree with
+    char **paths;
+    int npaths;
+};
+
+static char *default_path[] = { "." };
+
+// Fill in cmd from argv. Returns 0, or 1 after printing a usage error.
+static int parse_args(int argc, char *argv[], struct command *cmd) {
+    int opt;
+    memset(cmd, 0, sizeof(*cmd));
+    cmd->filters = calloc(argc, sizeof(struct filter_arg));
+    if (!cmd->filters) { perror("calloc"); return 1; }
+
+    static const struct option long_opts[] = {
+        {"cache", optional_argument, NULL, OPT_CACHE},
+        {"watch", no_argument, NULL, OPT_WATCH},
+        {"du", no_argument, NULL, OPT_DU},
+        {"all", no_argument, NULL, 'a'},
+        {"almost-all", no_argument, NULL, 'A'},
+        {"include", required_argument, NULL, OPT_INCLUDE},
+        {"exclude", required_argument, NULL, OPT_EXCLUDE},
+        {"include-regex", required_argument, NULL, OPT_INCLUDE_REGEX},
+        {"exclude-regex", required_argument, NULL, OPT_EXCLUDE_REGEX},
+        {"memory-limit", required_argument, NULL, OPT_MEMORY_LIMIT},
+        {"serve", required_argument, NULL, OPT_SERVE},
+        {"connect", required_argument, NULL, OPT_CONNECT},
+        {"snapshot", required_argument, NULL, OPT_SNAPSHOT},
+        {"diff", required_argument, NULL, OPT_DIFF},
+        {"stream", no_argument, NULL, OPT_STREAM},
+        {"max-depth", required_argument, NULL, OPT_MAX_DEPTH},
+        {"one-file-system", no_argument, NULL, OPT_ONE_FILE_SYSTEM},
+        {"prune", required_argument, NULL, OPT_PRUNE},
+        {NULL, 0, NULL, 0}
+    };
+
+    // The daemon parses one command line per request, so start afresh
+    optind = 0;
+    while ((opt = getopt_long(argc, argv, "lxRsaA", long_opts, NULL)) != -1) {
+        struct filter_arg *f = &cmd->filters[cmd->nfilters];
+        switch (opt) {
+            case 'l': cmd->opts.long_format = 1; break;
+            case 'x': cmd->opts.horizontal = 1; break;
+            case 'R': cmd->opts.recursive = 1; break;
+            case 's': cmd->opts.size = 1; break;
+            case 'a': cmd->opts.show = LS_SHOW_ALL; break;
+            case 'A': cmd->opts.show = LS_SHOW_ALMOST_ALL; break;
+            case OPT_CACHE: cmd->opts.cache_dir = optarg ? optarg : default_cache_dir(); break;
+            case OPT_WATCH: cmd->watch_flag = 1; break;
+            case OPT_DU: cmd->du_flag = 1; break;
+            case OPT_INCLUDE: *f = (struct filter_arg){ LS_FILTER_INCLUDE, optarg }; cmd->nfilters++; break;
+            case OPT_EXCLUDE: *f = (struct filter_arg){ LS_FILTER_EXCLUDE, optarg }; cmd->nfilters++; break;
+            case OPT_INCLUDE_REGEX: *f = (struct filter_arg){ LS_FILTER_INCLUDE | LS_FILTER_REGEX, optarg }; cmd->nfilters++; break;
+            case OPT_EXCLUDE_REGEX: *f = (struct filter_arg){ LS_FILTER_EXCLUDE | LS_FILTER_REGEX, optarg }; cmd->nfilters++; break;
+            case OPT_SERVE: cmd->serve = optarg; break;
+            case OPT_CONNECT: cmd->connect = optarg; break;
+            case OPT_SNAPSHOT: cmd->snapshot = optarg; break;
+            case OPT_DIFF: cmd->diff = optarg; break;
+            case OPT_STREAM: cmd->opts.stream = 1; break;
+            case OPT_ONE_FILE_SYSTEM: cmd->opts.one_file_system = 1; break;
+            case OPT_PRUNE: *f = (struct filter_arg){ LS_FILTER_PRUNE, optarg }; cmd->nfilters++; break;
+            case OPT_MAX_DEPTH: {
+                char *end;
+                long n = strtol(optarg, &end, 10);
+                if (end == optarg || *end || n < 1 || n > INT_MAX) {
+                    fprintf(stderr, "%s: invalid depth '%s'\n", argv[0], optarg);
+                    return 1;
+                }
+                cmd->opts.max_depth = (int)n;
+                break;
+            }
+            case OPT_MEMORY_LIMIT:
+                cmd->opts.memory_limit = parse_size(optarg);
+                if (cmd->opts.memory_limit == 0) {
+                    fprintf(stderr, "%s: invalid memory limit '%s'\n", argv[0], optarg);
+                    return 1;
+                }
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-l] [-x] [-R] [-s] [-a|-A] [--include=GLOB] [--exclude=GLOB]\n"
+                                "       [--include-regex=RE] [--exclude-regex=RE] [--memory-limit=SIZE]\n"
+                                "       [--stream] [--max-depth=N] [--one-file-system] [--prune=GLOB]\n"
+                                "       [--cache[=DIR]] [--watch] [--du] [path...]\n"
+                                "       %s [--diff=FILE] [--snapshot=FILE] [options] [path]\n"
+                                "       %s --serve=SOCKET | --connect=SOCKET [options] [path...]\n",
+                        argv[0], argv[0], argv[0]);
+                return 1;
+        }
+    }
+
+    cmd->paths = (optind < argc) ? &argv[optind] : default_path;
+    cmd->npaths = (optind < argc) ? argc - optind : 1;
+    return 0;
+}
+
+static struct ls_context *make_context(const struct command *cmd, const struct ls_options *opts) {
+    struct ls_context *ctx = ls_context_new(opts);
+    if (!ctx) { perror("ls_context_new"); return NULL; }
+    for (int i = 0; i < cmd->nfilters; i++) {
+        if (ls_add_filter(ctx, cmd->filters[i].flags, cmd->filters[i].pattern) == -1) {
+            ls_context_free(ctx);
+            return NULL;
+        }
+    }
+    return ctx;
+}
+
+// Run a parsed command, returning the exit status
+static int run_command(struct ls_context *ctx, const struct command *cmd, const char *prog) {
+    int status = 0;
+    if (cmd->watch_flag) {
+        if (cmd->opts.recursive || cmd->npaths > 1) {
+            fprintf(stderr, "%s: --watch takes a single directory and cannot be combined with -R\n", prog);
+            status = 1;
+        } else {
+            status = ls_watch(ctx, cmd->paths[0], stdout);
+        }
+    } else if (cmd->snapshot || cmd->diff) {
+        // Given both, report changes since the old snapshot, then replace it
+        if (cmd->npaths > 1) {
+            fprintf(stderr, "%s: --snapshot and --diff take a single directory\n", prog);
+            status = 1;
+        } else {
+            if (cmd->diff) status = ls_diff(ctx, cmd->paths[0], cmd->diff, stdout);
+            if (cmd->snapshot && status != 2 && ls_snapshot(ctx, cmd->paths[0], cmd->snapshot) != 0) status = 2;
+        }
+    } else if (cmd->du_flag) {
+        for (int i = 0; i < cmd->npaths; i++) {
+            if (i > 0) printf("\n");
+            if (ls_du(ctx, cmd->paths[i], stdout) != 0) status = 2;
+        }
+    } else {
+        status = ls_list_paths(ctx, cmd->paths, cmd->npaths, stdout);
+    }
+    return status;
+}
+
+// ----- Daemon protocol -----
+// A request is a 32-bit length followed by the client's argv as
+// NUL-terminated strings. The first message carries the client's cwd,
+// stdout and stderr as SCM_RIGHTS, so the daemon lists relative to the
+// client's directory and writes straight to its output. The reply is a
+// single byte: the exit status.
+#define MAX_REQUEST (1 << 20)
+#define REQUEST_TIMEOUT 2   // seconds a client may take to send its request
+
+static int socket_address(const char *path, struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) { errno = ENAMETOOLONG; return -1; }
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+static int read_full(int fd, void *buf, size_t len) {
+    char *p = buf;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Forward the command line to a daemon and return its exit status
+static int run_client(const char *sock_path, int argc, char *argv[]) {
+    struct sockaddr_un addr;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) { perror("socket"); return 2; }
+    if (socket_address(sock_path, &addr) == -1 ||
+        connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        perror(sock_path);
+        close(fd);
+        return 2;
+    }
+
+    size_t len = 0;
+    for (int i = 0; i < argc; i++) len += strlen(argv[i]) + 1;
+    char *req = malloc(sizeof(uint32_t) + len);
+    if (!req) { perror("malloc"); close(fd); return 2; }
+    uint32_t len32 = len;
+    memcpy(req, &len32, sizeof(len32));
+    char *p = req + sizeof(len32);
+    for (int i = 0; i < argc; i++) p = stpcpy(p, argv[i]) + 1;
+
+    int cwd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    int fds[3] = { cwd, STDOUT_FILENO, STDERR_FILENO };
+    char cbuf[CMSG_SPACE(sizeof(fds))];
+    struct iovec iov = { req, sizeof(len32) + len };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1,
+                          .msg_control = cbuf, .msg_controllen = sizeof(cbuf) };
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cm), fds, sizeof(fds));
+
+    int status = 2;
+    unsigned char reply;
+    fflush(stdout);
+    if (cwd == -1) perror(".");
+    else if (sendmsg(fd, &msg, MSG_NOSIGNAL) != (ssize_t)iov.iov_len) perror("sendmsg");
+    else if (read_full(fd, &reply, 1) == -1) fprintf(stderr, "%s: no reply from daemon\n", argv[0]);
+    else status = reply;
+
+    if (cwd != -1) close(cwd);
+    free(req);
+    close(fd);
+    return status;
+}
+
+// Contexts are kept per distinct set of options so their uid/gid caches
+// stay warm across requests. Listings are only kept in memory for
+// requests that asked for --cache: like the on-disk cache they are
+// revalidated against the directory's timestamps alone, so -l may show
+// stale sizes and times for files rewritten in place.
+#define MAX_CONTEXTS 16
+#define KEEP_LISTINGS 1024
+
+struct warm_context {
+    char *key;
+    struct ls_context *ctx;
+    unsigned long last_used;
+};
+
+static char *context_key(const struct command *cmd) {
+    char *key = NULL;
+    size_t len = 0;
+    FILE *fp = open_memstream(&key, &len);
+    if (!fp) return NULL;
+    const struct ls_options *o = &cmd->opts;
+    fprintf(fp, "%d %d %d %d %d %zu %d %d %d %s", o->long_format, o->horizontal, o->recursive,
+            o->size, o->show, o->memory_limit, o->stream, o->max_depth, o->one_file_system,
+            o->cache_dir ? o->cache_dir : "");
+    // Filters are separated by a byte that cannot occur in an argument
+    for (int i = 0; i < cmd->nfilters; i++)
+        fprintf(fp, "\x01%d%s", cmd->filters[i].flags, cmd->filters[i].pattern);
+    fclose(fp);
+    return key;
+}
+
+static struct ls_context *warm_context_for(struct warm_context *pool, const struct command *cmd) {
+    static unsigned long clock;
+    char *key = context_key(cmd);
+    if (!key) return NULL;
+
+    struct warm_context *slot = &pool[0];
+    for (int i = 0; i < MAX_CONTEXTS; i++) {
+        if (pool[i].key && strcmp(pool[i].key, key) == 0) {
+            free(key);
+            pool[i].last_used = ++clock;
+            return pool[i].ctx;
+        }
+        if (pool[i].last_used < slot->last_used) slot = &pool[i];
+    }
+
+    struct ls_options opts = cmd->opts;
+    if (opts.cache_dir) opts.keep_listings = KEEP_LISTINGS;
+    struct ls_context *ctx = make_context(cmd, &opts);
+    if (!ctx) { free(key); return NULL; }
+    free(slot->key);
+    ls_context_free(slot->ctx);
+    *slot = (struct warm_context){ key, ctx, ++clock };
+    return ctx;
+}
+
+// Receive one request with its descriptors. Returns the argv buffer
+// (len bytes), or NULL.
+static char *receive_request(int conn, int fds[3], size_t *len) {
+    uint32_t len32;
+    char cbuf[CMSG_SPACE(3 * sizeof(int))];
+    struct iovec iov = { &len32, sizeof(len32) };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1,
+                          .msg_control = cbuf, .msg_controllen = sizeof(cbuf) };
+
+    ssize_t n = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC);
+    // Every descriptor that arrived is now ours, so one that is not
+    // kept in fds must be closed rather than leaked
+    int nfds = 0;
+    for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); n > 0 && cm; cm = CMSG_NXTHDR(&msg, cm)) {
+        if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS) continue;
+        size_t k = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (size_t j = 0; j < k; j++, nfds++) {
+            int fd;
+            memcpy(&fd, CMSG_DATA(cm) + j * sizeof(int), sizeof(fd));
+            if (nfds < 3) fds[nfds] = fd;
+            else close(fd);
+        }
+    }
+    if (n <= 0 || nfds != 3 || (msg.msg_flags & MSG_CTRUNC)) {
+        for (int i = 0; i < 3 && i < nfds; i++) { close(fds[i]); fds[i] = -1; }
+        return NULL;
+    }
+    if (n < (ssize_t)sizeof(len32) && read_full(conn, (char *)&len32 + n, sizeof(len32) - n) == -1)
+        return NULL;
+    if (len32 == 0 || len32 > MAX_REQUEST) return NULL;
+
+    char *buf = malloc(len32);
+    if (!buf) return NULL;
+    if (read_full(conn, buf, len32) == -1 || buf[len32 - 1] != '\0') { free(buf); return NULL; }
+    *len = len32;
+    return buf;
+}
+
+// Copy everything written to a memfd so far to fd
+static int copy_out(int memfd, int fd) {
+    char buf[65536];
+    ssize_t n;
+    if (lseek(memfd, 0, SEEK_SET) == -1) return -1;
+    while ((n = read(memfd, buf, sizeof(buf))) > 0)
+        for (char *p = buf; n > 0; ) {
+            ssize_t w = write(fd, p, n);
+            if (w == -1 && errno == EINTR) continue;
+            if (w <= 0) return -1;
+            p += w;
+            n -= w;
+        }
+    return n == 0 ? 0 : -1;
+}
+
+// Hand a finished request's output and exit status to the client. This
+// is done from a child process, so a client whose reader stops taking
+// output holds up only that child and not the daemon.
+static void deliver(int conn, int out, int err, const int fds[3], unsigned char status) {
+    pid_t pid = fork();
+    if (pid > 0) return;
+    copy_out(out, fds[1]);
+    copy_out(err, fds[2]);
+    if (write(conn, &status, 1) != 1 && pid == -1) perror("write");
+    if (pid == 0) _exit(0);
+}
+
+// Run one forwarded command line with the client's cwd, and deliver its
+// output and exit status
+static void serve_request(struct warm_context *pool, char *buf, size_t len, const int fds[3], int conn) {
+    int argc = 0;
+    for (size_t i = 0; i < len; i++) if (buf[i] == '\0') argc++;
+    char **argv = calloc(argc + 1, sizeof(char *));
+    if (!argv) return;
+    for (size_t i = 0, k = 0; i < len; i += strlen(buf + i) + 1) argv[k++] = buf + i;
+
+    // Requests run one at a time, so the process-wide cwd, stdout and
+    // stderr can simply be switched for the duration: to the client's
+    // directory, and to memory files delivered to the client afterwards.
+    int saved_out = dup(STDOUT_FILENO), saved_err = dup(STDERR_FILENO);
+    int saved_cwd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    int out = memfd_create("ls-stdout", MFD_CLOEXEC), err = memfd_create("ls-stderr", MFD_CLOEXEC);
+    int status = 2;
+    if (saved_out != -1 && saved_err != -1 && saved_cwd != -1 && out != -1 && err != -1 &&
+        fchdir(fds[0]) == 0 && dup2(out, STDOUT_FILENO) != -1 && dup2(err, STDERR_FILENO) != -1) {
+        struct command cmd;
+        struct ls_context *ctx;
+        if (parse_args(argc, argv, &cmd) != 0) status = 1;
+        else if (cmd.serve || cmd.watch_flag) {
+            fprintf(stderr, "%s: --serve and --watch cannot be forwarded to a daemon\n", argv[0]);
+            status = 1;
+        } else if ((ctx = warm_context_for(pool, &cmd)) != NULL) {
+            status = run_command(ctx, &cmd, argv[0]);
+        }
+        free(cmd.filters);
+    }
+    fflush(stdout);
+    fflush(stderr);
+    if (saved_out != -1) { dup2(saved_out, STDOUT_FILENO); close(saved_out); }
+    if (saved_err != -1) { dup2(saved_err, STDERR_FILENO); close(saved_err); }
+    if (saved_cwd != -1) {
+        if (fchdir(saved_cwd) == -1) perror("fchdir");
+        close(saved_cwd);
+    }
+    deliver(conn, out, err, fds, status);
+    if (out != -1) close(out);
+    if (err != -1) close(err);
+    free(argv);
+}
+
+// Listen on a Unix socket and answer requests until killed
+static int run_daemon(const char *sock_path) {
+    struct sockaddr_un addr;
+    int lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (lfd == -1) { perror("socket"); return 2; }
+    if (socket_address(sock_path, &addr) == -1) { perror(sock_path); close(lfd); return 2; }
+    // Replace a socket left behind by an earlier daemon, but nothing else
+    struct stat st;
+    if (lstat(sock_path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            fprintf(stderr, "%s: exists and is not a socket\n", sock_path);
+            close(lfd);
+            return 2;
+        }
+        unlink(sock_path);
+    }
+    // Listings run with the daemon's credentials, so only its own user
+    // may connect: the socket is private and peers are checked below
+    mode_t old_mask = umask(0077);
+    int rc = bind(lfd, (struct sockaddr *)&addr, sizeof(addr));
+    umask(old_mask);
+    if (rc == -1 || listen(lfd, 64) == -1) {
+        perror(sock_path);
+        close(lfd);
+        return 2;
+    }
+    // A client that goes away mid-listing must not take the daemon with
+    // it, and delivering children need not be waited for
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGCHLD, SIG_IGN);
+
+    struct warm_context pool[MAX_CONTEXTS] = {{0}};
+    for (;;) {
+        int conn = accept4(lfd, NULL, NULL, SOCK_CLOEXEC);
+        if (conn == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            perror("accept");
+            break;
+        }
+        // Requests are served one at a time, so a peer that stalls must
+        // not hold up the others
+        struct ucred cred;
+        socklen_t cred_len = sizeof(cred);
+        struct timeval tv = { REQUEST_TIMEOUT, 0 };
+        if (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) == -1 ||
+            cred.uid != geteuid() ||
+            setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) == -1) {
+            close(conn);
+            continue;
+        }
+        int fds[3] = { -1, -1, -1 };
+        size_t len;
+        char *buf = receive_request(conn, fds, &len);
+        if (buf) {
+            serve_request(pool, buf, len, fds, conn);
+            free(buf);
+        }
+        for (int i = 0; i < 3; i++) if (fds[i] != -1) close(fds[i]);
+        close(conn);
+    }
+    close(lfd);
+    return 2;
+}
+
+int main(int argc, char *argv[]) {
+    struct command cmd;
+    if (parse_args(argc, argv, &cmd) != 0) { free(cmd.filters); return 1; }
+
+    int status;
+    if (cmd.serve) {
+        status = run_daemon(cmd.serve);
+    } else if (cmd.connect) {
+        status = run_client(cmd.connect, argc, argv);
+    } else {
+        struct ls_context *ctx = make_context(&cmd, &cmd.opts);
+        status = ctx ? run_command(ctx, &cmd, argv[0]) : 2;
+        ls_context_free(ctx);
+    }
+    free(cmd.filters);
+    return status;
+}